@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cstring>
 #include "aps6404.hpp"
 #include "hardware/dma.h"
 #include "hardware/irq.h"
@@ -71,24 +72,138 @@ namespace pimoroni {
     }
 
     void APS6404::adjust_clock() {
+        const uint32_t clock_hz = clock_get_hz(clk_sys);
+        if (calibrated_read_timing >= 0 && calibrated_clock_hz == clock_hz) {
+            set_read_timing(calibrated_read_timing);
+        }
+        else if (clock_hz > MAX_HALF_CLOCK_SYS_HZ) {
+            set_read_timing(4);
+        }
+        else if (clock_hz < 130000000) {
+            set_read_timing(0);
+        }
+        else {
+            set_read_timing(1);
+        }
+    }
+
+    // The normal program samples half a PSRAM clock later than the slow one, and bypassing
+    // the input synchronizers samples two system clocks later.  So in sample order:
+    //  0: slow  1: normal  2: slow, bypassed  3: normal, bypassed  4: fast  5: fast, bypassed
+    void APS6404::set_read_timing(int timing) {
         pio_sm_set_enabled(pio, pio_sm, false);
         pio_remove_program(pio, pio_prog, pio_offset);
 
-        if (clock_get_hz(clk_sys) > 285000000) {
+        const bool fast = timing >= 4;
+        const bool slow = !fast && (timing & 1) == 0;
+        if (fast) {
             pio_prog = &sram_fast_program;
-            pio_offset = pio_add_program(pio, &sram_fast_program);
-            aps6404_program_init(pio, pio_sm, pio_offset, pin_csn, pin_d0, false, true, false);
         }
-        else if (clock_get_hz(clk_sys) < 130000000) {
+        else if (slow) {
             pio_prog = &sram_slow_program;
-            pio_offset = pio_add_program(pio, &sram_slow_program);
-            aps6404_program_init(pio, pio_sm, pio_offset, pin_csn, pin_d0, true, false, false);
         }
         else {
             pio_prog = &sram_program;
-            pio_offset = pio_add_program(pio, &sram_program);
-            aps6404_program_init(pio, pio_sm, pio_offset, pin_csn, pin_d0, false, false, false);
         }
+        pio_offset = pio_add_program(pio, pio_prog);
+
+        const uint32_t data_pins = 0xFu << pin_d0;
+        if (fast ? timing == 5 : timing >= 2) {
+            hw_set_bits(&pio->input_sync_bypass, data_pins);
+        }
+        else {
+            hw_clear_bits(&pio->input_sync_bypass, data_pins);
+        }
+        aps6404_program_init(pio, pio_sm, pio_offset, pin_csn, pin_d0, slow, fast, false);
+
+        // Bursts may only cross a page with the PSRAM clock at up to 84MHz.
+        page_crossing_allowed = clock_get_hz(clk_sys) / (fast ? 3 : 2) <= 84000000;
+    }
+
+    void APS6404::wait_for_idle() {
+        // All the programs stall on the out at top + 1 while waiting for the next command
+        wait_for_finish_blocking();
+        while (!pio_sm_is_tx_fifo_empty(pio, pio_sm) || pio_sm_get_pc(pio, pio_sm) != pio_offset + 1)
+            tight_loop_contents();
+    }
+
+    int APS6404::calibrate(uint8_t& pass_mask, bool allow_half_clock_overclock) {
+        constexpr uint32_t TEST_LEN_IN_WORDS = 64;
+        constexpr uint32_t TEST_ADDR = RAM_SIZE - TEST_LEN_IN_WORDS * 4;
+        constexpr int NUM_TEST_READS = 8;
+        constexpr int NUM_SAVE_READS = 4;
+        uint32_t saved[TEST_LEN_IN_WORDS];
+        uint32_t pattern[TEST_LEN_IN_WORDS];
+        uint32_t read_buf[TEST_LEN_IN_WORDS];
+
+        // Writes don't depend on the read timing, so the test area is saved with the current
+        // timing and can be restored.  The current timing may not be reliable on this board,
+        // so unless several reads of the area agree it isn't touched and the timing is kept.
+        pass_mask = 0;
+        read_blocking(TEST_ADDR, saved, TEST_LEN_IN_WORDS);
+        for (int i = 1; i < NUM_SAVE_READS; ++i) {
+            read_blocking(TEST_ADDR, read_buf, TEST_LEN_IN_WORDS);
+            if (memcmp(read_buf, saved, sizeof(saved)) != 0) {
+                calibrated_read_timing = -1;
+                return -1;
+            }
+        }
+
+        // Every nibble value next to every other, then pseudo random data
+        uint32_t x = 0x9E3779B9;
+        for (uint32_t i = 0; i < TEST_LEN_IN_WORDS; ++i) {
+            if (i < 16) {
+                pattern[i] = (i * 0x11111111u) ^ ((i & 1) ? 0xFFFF0000u : 0x0000FFFFu);
+            }
+            else {
+                x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+                pattern[i] = x;
+            }
+        }
+        write(TEST_ADDR, pattern, TEST_LEN_IN_WORDS);
+        wait_for_idle();
+
+        for (int timing = 0; timing < NUM_READ_TIMINGS; ++timing) {
+            set_read_timing(timing);
+
+            bool pass = true;
+            for (int i = 0; i < NUM_TEST_READS && pass; ++i) {
+                memset(read_buf, 0, sizeof(read_buf));
+                read_blocking(TEST_ADDR, read_buf, TEST_LEN_IN_WORDS);
+                pass = memcmp(read_buf, pattern, sizeof(pattern)) == 0;
+            }
+            wait_for_idle();
+            if (pass) pass_mask |= 1 << timing;
+        }
+
+        // Widest run of passing half clock timings
+        int best_start = 0, best_len = 0;
+        for (int start = 0; start < 4; ++start) {
+            int len = 0;
+            while (start + len < 4 && (pass_mask & (1 << (start + len)))) ++len;
+            if (len > best_len) {
+                best_start = start;
+                best_len = len;
+            }
+        }
+
+        // Half clock timings run the PSRAM above its rated clock over MAX_HALF_CLOCK_SYS_HZ,
+        // a few passing test reads aren't enough to use them unless asked to.
+        const bool half_clock_allowed = allow_half_clock_overclock || clock_get_hz(clk_sys) <= MAX_HALF_CLOCK_SYS_HZ;
+
+        int timing = -1;
+        if (best_len >= 3 && half_clock_allowed) timing = best_start + best_len / 2;
+        else if (pass_mask & (1 << 4)) timing = 4;
+        else if (pass_mask & (1 << 5)) timing = 5;
+
+        calibrated_read_timing = timing;
+        calibrated_clock_hz = clock_get_hz(clk_sys);
+        adjust_clock();
+
+        write(TEST_ADDR, saved, TEST_LEN_IN_WORDS);
+        wait_for_finish_blocking();
+
+        return timing;
     }
 
     void APS6404::write(uint32_t addr, uint32_t* data, uint32_t len_in_words) {
@@ -117,7 +232,7 @@ namespace pimoroni {
     void APS6404::read(uint32_t addr, uint32_t* read_buf, uint32_t len_in_words) {
         start_read(read_buf, len_in_words);
 
-        uint32_t first_page_len = (PAGE_SIZE - (addr & (PAGE_SIZE - 1)));
+        uint32_t first_page_len = page_crossing_allowed ? PAGE_SIZE : (PAGE_SIZE - (addr & (PAGE_SIZE - 1)));
 
         if (first_page_len >= len_in_words << 2) {
             pio_sm_put_blocking(pio, pio_sm, (len_in_words * 8) - 4);
@@ -131,16 +246,17 @@ namespace pimoroni {
     }
 
     void APS6404::multi_read(uint32_t* addresses, uint32_t* lengths, uint32_t num_reads, uint32_t* read_buf, int chain_channel) {
-        uint32_t total_len = 0;
-        uint32_t* cmd_buf = multi_read_cmd_buffer;
-        for (uint32_t i = 0; i < num_reads; ++i) {
-            total_len += lengths[i];
-            cmd_buf = add_read_to_cmd_buffer(cmd_buf, addresses[i], lengths[i]);
-        }
+        // The command buffer may still be being sent for the previous read
+        dma_channel_wait_for_finish_blocking(read_cmd_dma_channel);
 
-        start_read(read_buf, total_len >> 2, chain_channel);
+        const uint32_t total_len = build_multi_read_cmds(addresses, lengths, num_reads);
+        multi_read_cmds(multi_read_cmd_buffer, multi_read_cmd_len, read_buf, total_len >> 2, chain_channel);
+    }
+
+    void APS6404::multi_read_cmds(const uint32_t* cmds, uint32_t num_cmd_words, uint32_t* read_buf, uint32_t total_len_in_words, int chain_channel) {
+        start_read(read_buf, total_len_in_words, chain_channel);
 
-        dma_channel_transfer_from_buffer_now(read_cmd_dma_channel, multi_read_cmd_buffer, cmd_buf - multi_read_cmd_buffer);
+        dma_channel_transfer_from_buffer_now(read_cmd_dma_channel, cmds, num_cmd_words);
     }
 
     void APS6404::start_read(uint32_t* read_buf, uint32_t total_len_in_words, int chain_channel) {
@@ -190,33 +306,6 @@ namespace pimoroni {
         channel_config_set_bswap(&read_config, true);        
     }
 
-    uint32_t* APS6404::add_read_to_cmd_buffer(uint32_t* cmd_buf, uint32_t addr, uint32_t len_in_bytes) {
-        int32_t len_remaining = len_in_bytes;
-        uint32_t len = std::min((PAGE_SIZE - (addr & (PAGE_SIZE - 1))), (uint32_t)len_remaining);
-
-        while (true) {
-            if (len < 2) {
-                *cmd_buf++ = 0;
-                *cmd_buf++ = 0xeb000000u | addr;
-                *cmd_buf++ = pio_offset + sram_offset_do_read_one;
-            }
-            else {
-                *cmd_buf++ = (len * 2) - 4;
-                *cmd_buf++ = 0xeb000000u | addr;
-                *cmd_buf++ = pio_offset + sram_offset_do_read;
-            }
-            len_remaining -= len;
-            addr += len;
-
-            if (len_remaining <= 0) break;
-
-            len = len_remaining;
-            if (len > PAGE_SIZE) len = PAGE_SIZE;
-        }
-
-        return cmd_buf;
-    }
-
     void APS6404::wait_for_finish_blocking() {
         dma_channel_wait_for_finish_blocking(dma_channel);
     }
@@ -18,8 +18,25 @@ namespace pimoroni {
             void set_spi();
 
             // Must be called if the system clock rate is changed after init().
+            // Uses the calibrated read timing if calibrate() was run at this clock.
             void adjust_clock();
 
+            // Read timings, in order of when the data is sampled.  The first four clock the PSRAM
+            // at half the system clock, the last two at a third of it.
+            static constexpr int NUM_READ_TIMINGS = 6;
+
+            // Above this system clock half clock timings would run the PSRAM over its rated 142MHz
+            static constexpr uint32_t MAX_HALF_CLOCK_SYS_HZ = 285000000;
+
+            // Try every read timing on a test pattern written to the last 256 bytes of RAM, which are restored afterwards.
+            // If the current timing can't read those bytes consistently they are left alone and no timing is tried.
+            // Picks the half clock timing in the middle of the widest passing range, if it is at least 3 wide,
+            // otherwise a third clock timing if one passes.  Above MAX_HALF_CLOCK_SYS_HZ half clock timings are
+            // only picked if allow_half_clock_overclock is set.  Returns the timing used, or -1 if none was
+            // reliable and the default for the clock was kept.  pass_mask gets a bit set for each timing that passed.
+            int calibrate(uint8_t& pass_mask, bool allow_half_clock_overclock = false);
+            void clear_calibration() { calibrated_read_timing = -1; }
+
             // Start a write, this completes asynchronously, this function blocks if another 
             // transfer is already in progress
             // Writes should always be <= 1KB.
@@ -31,8 +48,22 @@ namespace pimoroni {
 
             // Start multiple reads to the same buffer.  They completes asynchronously, 
             // this function only blocks if another transfer is already in progress
+            // Reads that are contiguous in PSRAM are merged into one burst, as are reads that
+            // continue from the end of a page to its start, where the PSRAM wraps bursts in the page.
             void multi_read(uint32_t* addresses, uint32_t* lengths, uint32_t num_addresses, uint32_t* read_buf, int chain_channel = -1);
 
+            // The command list built by the last multi_read.  Passing a copy of it to multi_read_cmds
+            // repeats the same reads, for as long as get_read_cmd_format() is unchanged.
+            const uint32_t* get_multi_read_cmds(uint32_t& num_cmd_words) const {
+                num_cmd_words = multi_read_cmd_len;
+                return multi_read_cmd_buffer;
+            }
+            // Changes when the PIO program or burst splitting changes, making built command lists invalid
+            uint32_t get_read_cmd_format() const { return pio_offset | (page_crossing_allowed ? 0x10000 : 0); }
+
+            // Start reads from a command list built by multi_read, total_len_in_words is the total length of the reads
+            void multi_read_cmds(const uint32_t* cmds, uint32_t num_cmd_words, uint32_t* read_buf, uint32_t total_len_in_words, int chain_channel = -1);
+
             // Read and block until completion
             void read_blocking(uint32_t addr, uint32_t* read_buf, uint32_t len_in_words) {
                 read(addr, read_buf, len_in_words);
@@ -42,10 +73,19 @@ namespace pimoroni {
             // Block until any outstanding read or write completes
             void wait_for_finish_blocking();
 
+            // Whether a read or write is still in progress
+            bool is_busy() const { return dma_channel_is_busy(dma_channel); }
+
         private:
             void start_read(uint32_t* read_buf, uint32_t total_len_in_words, int chain_channel = -1);
             void setup_dma_config();
-            uint32_t* add_read_to_cmd_buffer(uint32_t* cmd_buf, uint32_t addr, uint32_t len_in_words);
+            void set_read_timing(int timing);
+            void wait_for_idle();
+            // Build the commands for multi_read in multi_read_cmd_buffer, returns the total length in bytes
+            uint32_t build_multi_read_cmds(const uint32_t* addresses, const uint32_t* lengths, uint32_t num_reads);
+            // If wrap_in_page is set the read is one burst that wraps from the end of its page to the start,
+            // len_in_bytes must then be at most a page.
+            uint32_t* add_read_to_cmd_buffer(uint32_t* cmd_buf, uint32_t addr, uint32_t len_in_bytes, bool wrap_in_page = false);
 
             uint pin_csn;  // CSn, SCK must be next pin after CSn
             uint pin_d0;   // D0, D1, D2, D3 must be consecutive
@@ -63,5 +103,11 @@ namespace pimoroni {
 
             static constexpr int MULTI_READ_MAX_PAGES = 128;
             uint32_t multi_read_cmd_buffer[3 * MULTI_READ_MAX_PAGES];
+            uint32_t multi_read_cmd_len = 0;
+            bool page_crossing_allowed = false;
+
+            // Set by calibrate(), the calibrated timing is only used at the clock it was found for
+            int8_t calibrated_read_timing = -1;
+            uint32_t calibrated_clock_hz = 0;
     };
 }
@@ -0,0 +1,73 @@
+#include <algorithm>
+#include "aps6404.hpp"
+#include "aps6404.pio.h"
+
+// Building the PSRAM read command lists.  This doesn't touch the hardware,
+// so the host tools in tools/frame_budget build it too.
+
+namespace pimoroni {
+    uint32_t APS6404::build_multi_read_cmds(const uint32_t* addresses, const uint32_t* lengths, uint32_t num_reads) {
+        // Reads that continue straight on from the previous one are merged into one burst.
+        // When bursts can't cross a page the PSRAM wraps them back to the start of the page,
+        // so a read that ends at the end of a page followed by one from the start of the same
+        // page is also one burst, as long as the total is no longer than a page.
+        uint32_t total_len = 0;
+        uint32_t* cmd_buf = multi_read_cmd_buffer;
+        for (uint32_t i = 0; i < num_reads; ) {
+            const uint32_t addr = addresses[i];
+            const uint32_t page_start = addr & ~(PAGE_SIZE - 1);
+            uint32_t len = lengths[i++];
+            uint32_t next_addr = addr + len;
+            bool wrapped = false;
+            while (i < num_reads) {
+                if (addresses[i] == next_addr) {
+                    if (wrapped && len + lengths[i] > PAGE_SIZE) break;
+                }
+                else if (!page_crossing_allowed && !wrapped && next_addr == page_start + PAGE_SIZE &&
+                         addresses[i] == page_start && len + lengths[i] <= PAGE_SIZE)
+                {
+                    wrapped = true;
+                }
+                else break;
+
+                next_addr = addresses[i] + lengths[i];
+                len += lengths[i++];
+            }
+
+            total_len += len;
+            cmd_buf = add_read_to_cmd_buffer(cmd_buf, addr, len, wrapped);
+        }
+
+        multi_read_cmd_len = cmd_buf - multi_read_cmd_buffer;
+        return total_len;
+    }
+
+    uint32_t* APS6404::add_read_to_cmd_buffer(uint32_t* cmd_buf, uint32_t addr, uint32_t len_in_bytes, bool wrap_in_page) {
+        // Split into bursts that don't cross a page, or when that is allowed, that are no longer than a page
+        int32_t len_remaining = len_in_bytes;
+        uint32_t len = (page_crossing_allowed || wrap_in_page) ? PAGE_SIZE : (PAGE_SIZE - (addr & (PAGE_SIZE - 1)));
+        len = std::min(len, (uint32_t)len_remaining);
+
+        while (true) {
+            if (len < 2) {
+                *cmd_buf++ = 0;
+                *cmd_buf++ = 0xeb000000u | addr;
+                *cmd_buf++ = pio_offset + sram_offset_do_read_one;
+            }
+            else {
+                *cmd_buf++ = (len * 2) - 4;
+                *cmd_buf++ = 0xeb000000u | addr;
+                *cmd_buf++ = pio_offset + sram_offset_do_read;
+            }
+            len_remaining -= len;
+            addr += len;
+
+            if (len_remaining <= 0) break;
+
+            len = len_remaining;
+            if (len > PAGE_SIZE) len = PAGE_SIZE;
+        }
+
+        return cmd_buf;
+    }
+}
@@ -0,0 +1,176 @@
+#include <cstring>
+#include <algorithm>
+#include "pico/stdlib.h"
+#include "blitter.hpp"
+
+bool Blitter::queue_command(const uint8_t* cmd) {
+    if (queue_write_idx - queue_read_idx == QUEUE_LEN) {
+        ++num_dropped;
+        return false;
+    }
+
+    memcpy(queue[queue_write_idx % QUEUE_LEN], cmd, COMMAND_LEN);
+    __compiler_memory_barrier();
+    queue_write_idx = queue_write_idx + 1;
+    return true;
+}
+
+bool Blitter::start_next_command() {
+    while (queue_read_idx != queue_write_idx) {
+        const uint8_t* data = queue[queue_read_idx % QUEUE_LEN];
+        cmd.op = Op(data[0]);
+        cmd.pixel_size = data[1];
+        cmd.dest_addr = data[2] | (data[3] << 8) | (data[4] << 16);
+        cmd.src_addr = data[5] | (data[6] << 8) | (data[7] << 16);
+        cmd.width = data[8] | (data[9] << 8);
+        cmd.height = data[10] | (data[11] << 8);
+        cmd.dest_stride = data[12] | (data[13] << 8);
+        cmd.src_stride = data[14] | (data[15] << 8);
+        cmd.value = data[16] | (data[17] << 8) | (data[18] << 16) | (data[19] << 24);
+        __compiler_memory_barrier();
+        queue_read_idx = queue_read_idx + 1;
+
+        if (cmd.op == OP_CONVERT_RGB888) cmd.pixel_size = 2;
+        const uint32_t src_pixel_size = (cmd.op == OP_CONVERT_RGB888) ? 3 : cmd.pixel_size;
+        if (cmd.pixel_size < 4) cmd.value &= (1u << (cmd.pixel_size * 8)) - 1;
+
+        if (cmd.width == 0 || cmd.height == 0) {
+            ++num_completed;
+            continue;
+        }
+
+        // Ignore commands that aren't understood or are outside the RAM
+        const uint64_t dest_end = cmd.dest_addr + uint64_t(cmd.height - 1) * cmd.dest_stride + cmd.width * cmd.pixel_size;
+        const uint64_t src_end = cmd.src_addr + uint64_t(cmd.height - 1) * cmd.src_stride + cmd.width * src_pixel_size;
+        if (cmd.op < OP_FILL || cmd.op > OP_CONVERT_RGB888 ||
+            (cmd.pixel_size != 1 && cmd.pixel_size != 2 && cmd.pixel_size != 4) ||
+            dest_end > pimoroni::APS6404::RAM_SIZE ||
+            (cmd.op != OP_FILL && src_end > pimoroni::APS6404::RAM_SIZE))
+        {
+            ++num_invalid;
+            ++num_completed;
+            continue;
+        }
+
+        // Overlapping copies are done in reverse when the destination is after the source, as memmove.
+        // That only works if each source pixel maps to the destination pixel at the same offset.
+        const bool overlap = cmd.op != OP_FILL && cmd.dest_addr < src_end && cmd.src_addr < dest_end;
+        if (overlap && (cmd.op == OP_CONVERT_RGB888 || cmd.dest_stride != cmd.src_stride)) {
+            ++num_invalid;
+            ++num_completed;
+            continue;
+        }
+        cmd.reverse = overlap && cmd.dest_addr > cmd.src_addr;
+
+        cmd_active = true;
+        if (cmd.reverse) {
+            line = cmd.height - 1;
+            x = last_chunk_x();
+        }
+        else {
+            line = 0;
+            x = 0;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+void Blitter::discard() {
+    if (cmd_active) {
+        cmd_active = false;
+        ++num_invalid;
+        ++num_completed;
+    }
+    while (queue_read_idx != queue_write_idx) {
+        queue_read_idx = queue_read_idx + 1;
+        ++num_invalid;
+        ++num_completed;
+    }
+}
+
+bool Blitter::step() {
+    if (!cmd_active && !start_next_command()) return false;
+
+    const uint32_t src_pixel_size = (cmd.op == OP_CONVERT_RGB888) ? 3 : cmd.pixel_size;
+    const uint32_t num_pixels = std::min(uint32_t(cmd.width - x), CHUNK_LEN / cmd.pixel_size);
+
+    // The destination is rounded out to whole words, the bytes either side of the
+    // rectangle are read first so they are written back unchanged.
+    const uint32_t dest_addr = cmd.dest_addr + line * cmd.dest_stride + x * cmd.pixel_size;
+    const uint32_t dest_offset = dest_addr & 3;
+    const uint32_t dest_len = num_pixels * cmd.pixel_size;
+    const uint32_t dest_len_in_words = (dest_offset + dest_len + 3) >> 2;
+    uint8_t* dest = (uint8_t*)dest_buf + dest_offset;
+    if (dest_offset != 0 || (dest_len & 3) != 0 || cmd.op == OP_COPY_KEYED) {
+        ram.read_blocking(dest_addr - dest_offset, dest_buf, dest_len_in_words);
+    }
+
+    const uint8_t* src = nullptr;
+    if (cmd.op != OP_FILL) {
+        const uint32_t src_addr = cmd.src_addr + line * cmd.src_stride + x * src_pixel_size;
+        const uint32_t src_offset = src_addr & 3;
+        ram.read_blocking(src_addr - src_offset, src_buf, (src_offset + num_pixels * src_pixel_size + 3) >> 2);
+        src = (const uint8_t*)src_buf + src_offset;
+    }
+
+    switch (cmd.op) {
+        case OP_FILL:
+            for (uint32_t i = 0; i < dest_len; ++i) {
+                dest[i] = cmd.value >> ((i % cmd.pixel_size) * 8);
+            }
+            break;
+
+        case OP_COPY:
+            memcpy(dest, src, dest_len);
+            break;
+
+        case OP_COPY_KEYED:
+            for (uint32_t i = 0; i < dest_len; i += cmd.pixel_size) {
+                uint32_t pixel = 0;
+                for (uint32_t b = 0; b < cmd.pixel_size; ++b) {
+                    pixel |= src[i + b] << (b * 8);
+                }
+                if (pixel != cmd.value) memcpy(dest + i, src + i, cmd.pixel_size);
+            }
+            break;
+
+        case OP_CONVERT_RGB888:
+            for (uint32_t i = 0; i < num_pixels; ++i, src += 3) {
+                const uint32_t pixel = (cmd.value ? 0x8000 : 0) | ((src[0] >> 3) << 10) | ((src[1] >> 3) << 5) | (src[2] >> 3);
+                dest[i * 2] = pixel;
+                dest[i * 2 + 1] = pixel >> 8;
+            }
+            break;
+    }
+
+    ram.write(dest_addr - dest_offset, dest_buf, dest_len_in_words);
+    ram.wait_for_finish_blocking();
+
+    if (cmd.reverse) {
+        if (x != 0) {
+            x -= CHUNK_LEN / cmd.pixel_size;
+        }
+        else if (line != 0) {
+            --line;
+            x = last_chunk_x();
+        }
+        else {
+            cmd_active = false;
+            ++num_completed;
+        }
+    }
+    else {
+        x += num_pixels;
+        if (x == cmd.width) {
+            x = 0;
+            if (++line == cmd.height) {
+                cmd_active = false;
+                ++num_completed;
+            }
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "aps6404.hpp"
+
+// Rectangle operations on PSRAM, run by the display driver in spare bus time.
+//
+// Commands are 20 bytes, multi-byte values little endian:
+//  Byte 0: Operation, see Op
+//  Byte 1: Pixel size in bytes: 1, 2 or 4.  Ignored for OP_CONVERT_RGB888, which reads 3 and writes 2.
+//  Bytes 2-4: Destination address
+//  Bytes 5-7: Source address, unused for OP_FILL
+//  Bytes 8-9: Width in pixels
+//  Bytes 10-11: Height in lines
+//  Bytes 12-13: Destination stride in bytes
+//  Bytes 14-15: Source stride in bytes
+//  Bytes 16-19: Fill value for OP_FILL, transparent key for OP_COPY_KEYED, alpha (0 or 1) for OP_CONVERT_RGB888.
+//               Only the low pixel size bytes are used.
+//
+// The source and destination of OP_COPY and OP_COPY_KEYED may overlap, for example to scroll, if their
+// strides are equal.  Other overlapping commands are invalid and ignored.
+//
+// A command may take several frames, and always works on the RAM bank being displayed, so commands
+// only run in single bank mode.  When the app switches banks the driver calls discard instead of step.
+class Blitter {
+    public:
+        static constexpr int COMMAND_LEN = 20;
+        static constexpr int QUEUE_LEN = 8;
+
+        enum Op : uint8_t {
+            OP_FILL = 1,
+            OP_COPY = 2,
+            OP_COPY_KEYED = 3,      // Source pixels equal to the key are not copied
+            OP_CONVERT_RGB888 = 4,  // RGB888 source to ARGB1555 destination
+        };
+
+        Blitter(pimoroni::APS6404& aps6404)
+            : ram(aps6404)
+        {}
+
+        // Add a command to the queue, may be called from an interrupt.
+        // Returns false if the queue is full, the command is then dropped.
+        bool queue_command(const uint8_t* cmd);
+
+        // Process the next chunk of at most CHUNK_LEN bytes of the current command, blocking on the PSRAM.
+        // Returns false if there is nothing to do.
+        bool step();
+
+        // Drop the command in progress, leaving it partly done, and all queued commands.  They are counted as rejected.
+        void discard();
+
+        // Commands finished, including those that were invalid and ignored
+        uint32_t get_num_completed() const { return num_completed; }
+
+        // Commands dropped because the queue was full, or ignored because they were invalid or discarded
+        uint32_t get_num_rejected() const { return num_dropped + num_invalid; }
+        void clear_num_rejected() { num_dropped = 0; num_invalid = 0; }
+
+    private:
+        static constexpr uint32_t CHUNK_LEN = 128;
+
+        struct Command {
+            Op op;
+            uint8_t pixel_size;
+            uint32_t dest_addr;
+            uint32_t src_addr;
+            uint16_t width;
+            uint16_t height;
+            uint16_t dest_stride;
+            uint16_t src_stride;
+            uint32_t value;
+            bool reverse;  // Process lines bottom up and chunks right to left, for overlapping copies
+        };
+
+        bool start_next_command();
+
+        // x of the last chunk of a line
+        uint16_t last_chunk_x() const {
+            const uint32_t chunk_pixels = CHUNK_LEN / cmd.pixel_size;
+            return ((cmd.width - 1) / chunk_pixels) * chunk_pixels;
+        }
+
+        pimoroni::APS6404& ram;
+
+        // Written by queue_command, read by step
+        uint8_t queue[QUEUE_LEN][COMMAND_LEN];
+        volatile uint32_t queue_write_idx = 0;
+        volatile uint32_t queue_read_idx = 0;
+
+        // The command in progress, and how far through it we are
+        Command cmd;
+        bool cmd_active = false;
+        uint16_t line = 0;
+        uint16_t x = 0;
+
+        uint32_t num_completed = 0;
+        volatile uint32_t num_dropped = 0;  // Written by queue_command
+        uint32_t num_invalid = 0;
+
+        // Source and destination data for a chunk, with room to round out to whole words
+        uint32_t src_buf[(CHUNK_LEN * 3 / 2) / 4 + 2];
+        uint32_t dest_buf[CHUNK_LEN / 4 + 2];
+};
@@ -4,6 +4,20 @@
 #define SUPPORT_WIDE_MODES 0
 #endif
 
+// Number of line pair buffers that PSRAM reads go into.  With more than 2 the reads
+// run further ahead of scanline preparation, at the cost of ~4kB of SRAM per pair
+// (at the maximum frame width).
+#ifndef NUM_LINE_BUFFER_PAIRS
+#define NUM_LINE_BUFFER_PAIRS 2
+#endif
+static_assert(NUM_LINE_BUFFER_PAIRS >= 2, "At least 2 line pair buffers are required");
+
+// Words of SRAM used to keep the PSRAM read commands for each line pair, so they are only
+// built when the frame table or scroll changes.  Pairs that don't fit are built every frame.
+#ifndef LINE_READ_CMD_CACHE_WORDS
+#define LINE_READ_CMD_CACHE_WORDS 1536
+#endif
+
 constexpr int PALETTE_SIZE = 32;
 constexpr int NUM_SCROLL_GROUPS = 8;
 
@@ -17,7 +31,7 @@ constexpr int MAX_SPRITE_DATA_BYTES = 0xD800;
 constexpr int MAX_SPRITE_WIDTH = 64;
 constexpr int MAX_SPRITE_HEIGHT = 32;
 constexpr int MAX_PATCHES_PER_LINE = 10;
-constexpr int NUM_LINE_BUFFERS = 4;
+constexpr int NUM_LINE_BUFFERS = NUM_LINE_BUFFER_PAIRS * 2;
 constexpr int NUM_TMDS_BUFFERS = 8;
 #else
 // Support for modes up to 720p30, require extreme overclocks
@@ -29,6 +43,6 @@ constexpr int MAX_SPRITE_DATA_BYTES = 20480;
 constexpr int MAX_SPRITE_WIDTH = 64;
 constexpr int MAX_SPRITE_HEIGHT = 32;
 constexpr int MAX_PATCHES_PER_LINE = 10;
-constexpr int NUM_LINE_BUFFERS = 4;
+constexpr int NUM_LINE_BUFFERS = NUM_LINE_BUFFER_PAIRS * 2;
 constexpr int NUM_TMDS_BUFFERS = 7;
 #endif
\ No newline at end of file
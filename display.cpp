@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <cstring>
+#include <cstdlib>
 #include "pico/stdlib.h"
 #include "pico/multicore.h"
 #include "display.hpp"
@@ -26,10 +27,14 @@ using namespace pico_stick;
 
 #define TEST_SPRITES 0
 
+// Load sprites that start further down the frame during the active lines instead of at VSYNC
+#define DEFER_SPRITE_LOADING 1
+
 static pico_stick::FrameTableEntry __attribute__((section(".usb_ram.frame_table"))) the_frame_table[MAX_FRAME_HEIGHT];
 
 DisplayDriver::DisplayDriver(PIO pio)
     : frame_data(ram)
+    , blitter(ram)
     , current_res(RESOLUTION_720x480)
     , ram(PIN_RAM_CS, PIN_RAM_D0)
     , dvi0{
@@ -93,16 +98,20 @@ void DisplayDriver::run_core1() {
         sem_acquire_blocking(&dvi_start_sem);
         printf("Core 1 up\n");
         dvi_start(&dvi0);
+        uint32_t read_idx = line_ring_done_idx;
         while (true) {
-            uint32_t line_counter = multicore_fifo_pop_blocking();
-            const int8_t lmode = (line_counter & 0xFF000000u) >> 24;
-            line_counter &= 0xFFFFFFu;
-            uint32_t *colourbuf = (uint32_t*)multicore_fifo_pop_blocking();
-            if (!colourbuf) break;
+            while (line_ring_write_idx == read_idx) __wfe();
+            __dmb();
+
+            const LineDescriptor& desc = line_ring[read_idx & (LINE_RING_SIZE - 1)];
+            if (!desc.colour_buf) break;
+
+            diags.scanline_total_sync_time[1] += time_us_32() - desc.publish_time;
+            prepare_scanline_core1(desc.line_number, desc.colour_buf, desc.tmds_buf, desc.line_mode, desc.late);
 
-            uint32_t *tmdsbuf = (uint32_t*)multicore_fifo_pop_blocking();
-            prepare_scanline_core1(line_counter, colourbuf, tmdsbuf, lmode);
-            multicore_fifo_push_blocking(0);
+            __dmb();
+            line_ring_done_idx = ++read_idx;
+            __sev();
         }
     }
     __builtin_unreachable();
@@ -159,9 +168,17 @@ void DisplayDriver::init() {
     printf("Available VSYNC time: %luus\n", diags.available_vsync_time);
     printf("Available time for all active scanlines: %luus\n", diags.available_total_scanline_time);
     printf("Available time per scanline: %luus\n", diags.available_time_per_scanline);
+
+    // Each core has two scanlines to prepare each of its lines, histogram bins 12 and up are over that
+    line_trace.bin_width = std::max(uint32_t(1), (diags.available_time_per_scanline * 2 + 11) / 12);
+    line_trace.trace_threshold = (diags.available_time_per_scanline * 3) / 2;
 }
 
 void DisplayDriver::run() {
+    frame_data.set_header_address(next_header_address);
+    last_header_address = frame_data.get_header_address();
+    next_frame_started = false;
+    frame_data.invalidate_frame_table();
     if (!frame_data.read_headers()) {
         printf("Failed to read header\n");
         return;
@@ -169,6 +186,8 @@ void DisplayDriver::run() {
     printf("Configured display size %dx%d, v rep=%d\n", frame_data.config.h_length, frame_data.config.v_length, frame_data.config.v_repeat);
     dvi0.vertical_repeat = frame_data.config.v_repeat;
 
+    line_ring_write_idx = 0;
+    line_ring_done_idx = 0;
 	multicore_launch_core1(core1_main);
     multicore_fifo_push_blocking(uint32_t(this));
 
@@ -202,6 +221,8 @@ void DisplayDriver::run() {
     uint heartbeat = 9;
     //int frame_address_dir = 4;
     while (!stop_display) {
+        if (vsync_callback) vsync_callback();
+
         if (heartbet_led) {
             uint val;
             if (heartbeat < 32) val = heartbeat << 3;
@@ -212,43 +233,20 @@ void DisplayDriver::run() {
         }
 
         uint32_t vsync_start_time = time_us_32();
+        uint32_t phase_start = vsync_start_time;
 
         if (spi_mode) {
             ram.set_qpi();
         }
 
-        if (!frame_data.read_headers()) {
-            // TODO!
-            return;
-        }
-        //printf("%hdx%hd\n", frame_data.config.h_length, frame_data.config.v_length);
-
-        // Update frame counter
-        if (frame_data.frame_table_header.bank_number != last_bank) {
-            frame_counter = frame_data.frame_table_header.first_frame;
-            last_bank = frame_data.frame_table_header.bank_number;
-            frames_to_next_count = frame_data.frame_table_header.frame_rate_divider;
-
-            if (frame_data.frame_table_header.palette_advance || palette_idx >= frame_data.frame_table_header.num_palettes) {
-                palette_idx = 0;
-            }
+        // The next frame may have been started during the last lines of the previous frame
+        const bool headers_valid = next_frame_started || start_next_frame();
+        if (!headers_valid) {
+            ++diags.header_failures;
+            if (!keep_last_good_frame) return;
         }
-        else if (frame_data.frame_table_header.frame_rate_divider != 0)
-        {
-            if (--frames_to_next_count <= 0) {
-                if (++frame_counter >= frame_data.frame_table_header.num_frames) {
-                    frame_counter = 0;
-                }
-                if (frame_data.frame_table_header.palette_advance && ++palette_idx >= frame_data.frame_table_header.num_palettes) {
-                    palette_idx = 0;
-                }
-                frames_to_next_count = frame_data.frame_table_header.frame_rate_divider;
-            }
-        }
-
-        //pwm_set_gpio_level(PIN_LED, frame_data.frame_table_header.bank_number ? 255*255 : 0);
-
-        frame_data.get_frame_table(frame_counter, frame_table);
+        next_frame_started = false;
+        ram.wait_for_finish_blocking();
 
         if (frame_data.config.v_repeat != dvi0.vertical_repeat) {
             printf("Changing v repeat to %d\n", frame_data.config.v_repeat);
@@ -257,21 +255,33 @@ void DisplayDriver::run() {
                 __compiler_memory_barrier();
             dvi0.vertical_repeat = frame_data.config.v_repeat;
         }
+        diags.vsync_header_time = end_phase(phase_start);
 
-        setup_palette();
+        // Without valid headers the palettes and sprites can't be found, so the LUTs are left
+        // as they are and the sprites loaded for the last frame are shown again.
+        if (headers_valid) {
+            advance_colour_cycle();
+            setup_palette();
+        }
+        diags.vsync_palette_time = end_phase(phase_start);
 
-        update_sprites();
+        if (headers_valid) update_sprites();
+        else reuse_loaded_sprites();
+        diags.vsync_sprite_time = end_phase(phase_start);
 
         // Update offsets
         for (int i = 1; i < NUM_SCROLL_GROUPS; ++i) {
             frame_scroll[i] = next_frame_scroll[i];
         }
 
+        validate_line_read_cmds();
+
         // Read first 2 lines
         line_counter = 0;
         read_two_lines(0);
         ram.wait_for_finish_blocking();
         line_counter = 2;
+        diags.vsync_line_read_time = end_phase(phase_start);
 
         diags.peak_scanline_time = std::max(diags.peak_scanline_time, std::max(diags.scanline_max_prep_time[0], diags.scanline_max_prep_time[1]));
         diags.vsync_time = time_us_32() - vsync_start_time;
@@ -288,6 +298,8 @@ void DisplayDriver::run() {
 
         if (diags_callback) {
             diags.total_late_scanlines = dvi0.total_late_scanlines;
+            diags.blits_completed = blitter.get_num_completed();
+            diags.blits_rejected = blitter.get_num_rejected();
             diags_callback(diags);
         }
 
@@ -298,13 +310,37 @@ void DisplayDriver::run() {
         diags.scanline_max_prep_time[1] = 0;
         diags.scanline_max_sprites[0] = 0;
         diags.scanline_max_sprites[1] = 0;
+        diags.scanline_total_sync_time[0] = 0;
+        diags.scanline_total_sync_time[1] = 0;
+        diags.line_read_stalls = 0;
+        diags.sprites_deferred = 0;
+        diags.sprites_loaded_late = 0;
+        diags.fifo_wait_time = 0;
+        diags.ram_wait_time = 0;
+        for (int i = 0; i < 2; ++i) {
+            diags.degraded_lines[i] = 0;
+            diags.degraded_patches_skipped[i] = 0;
+            diags.degraded_blends[i] = 0;
+            diags.patch_time[i] = 0;
+            diags.encode_time[i] = 0;
+        }
+
+        // Publish the line time histogram for the frame just output
+        for (int i = 0; i < LINE_TIME_HISTOGRAM_BINS; ++i) {
+            line_trace.histogram[i] = line_time_histogram[0][i] + line_time_histogram[1][i];
+            line_time_histogram[0][i] = 0;
+            line_time_histogram[1][i] = 0;
+        }
+        ++line_trace.frame;
 
         main_loop();
 
         gpio_put(PIN_VSYNC, 0);
 
         // Grace period for slow RAM bank switch
-        sleep_us(10);
+        if (!single_bank_mode) {
+            sleep_us(10);
+        }
 
 #if TEST_SPRITES
         // Temp: Move our sprites around
@@ -379,14 +415,111 @@ void DisplayDriver::run() {
     stop_display = false;
 }
 
+// Read the headers for the next frame, update the frame counter and start reading the frame table
+bool DisplayDriver::start_next_frame() {
+    // Latch the header address, a change is treated the same as a bank switch
+    frame_data.set_header_address(next_header_address);
+    if (!frame_data.read_headers()) {
+        // Stay on the last good frame's headers, the new address is tried again next frame
+        frame_data.set_header_address(last_header_address);
+        return false;
+    }
+
+    const bool header_address_changed = frame_data.get_header_address() != last_header_address;
+    last_header_address = frame_data.get_header_address();
+    //printf("%hdx%hd\n", frame_data.config.h_length, frame_data.config.v_length);
+
+    // Update frame counter
+    if (frame_data.frame_table_header.bank_number != last_bank || header_address_changed) {
+        frame_counter = frame_data.frame_table_header.first_frame;
+        last_bank = frame_data.frame_table_header.bank_number;
+        frames_to_next_count = frame_data.frame_table_header.frame_rate_divider;
+
+        if (frame_data.frame_table_header.palette_advance || palette_idx >= frame_data.frame_table_header.num_palettes) {
+            palette_idx = 0;
+        }
+    }
+    else if (frame_data.frame_table_header.frame_rate_divider != 0)
+    {
+        if (--frames_to_next_count <= 0) {
+            if (++frame_counter >= frame_data.frame_table_header.num_frames) {
+                frame_counter = 0;
+            }
+            if (frame_data.frame_table_header.palette_advance && ++palette_idx >= frame_data.frame_table_header.num_palettes) {
+                palette_idx = 0;
+            }
+            frames_to_next_count = frame_data.frame_table_header.frame_rate_divider;
+        }
+    }
+
+    //pwm_set_gpio_level(PIN_LED, frame_data.frame_table_header.bank_number ? 255*255 : 0);
+
+    frame_data.get_frame_table(frame_counter, frame_table);
+
+    return true;
+}
+
 void DisplayDriver::main_loop() {
-    uint pixel_data_read_idx = 1;
-    while (line_counter < frame_data.config.v_length + 2) {
-        if (line_counter < frame_data.config.v_length) {
-            // Read two lines into the buffers we just output
-            read_two_lines(pixel_data_read_idx);
+    // The first line pair was read into slot 0 during VSYNC
+    uint read_slot = 1;
+    uint output_slot = 0;
+    uint32_t min_ahead = NUM_LINE_BUFFER_PAIRS;
+
+    // Whether the last PSRAM transfer started was a line read, it may instead be the next frame's table
+    bool line_read_in_flight = false;
+
+    // The next frame's headers may be read before this frame is finished
+    const int v_length = frame_data.config.v_length;
+    output_h_length = frame_data.config.h_length;
+
+    for (int output_line = 0; output_line < v_length; output_line += 2) {
+        // Starting a read waits for the previous one, so if that is still reading
+        // the pair we are about to output then the reads have fallen behind.
+        if (line_counter == output_line + 2 && line_read_in_flight && ram.is_busy()) {
+            ++diags.line_read_stalls;
+        }
+
+        // Read ahead into all the free buffers, but don't wait on the PSRAM
+        // unless the pair we are about to output isn't ready yet.
+        const int first_line_read = line_counter;
+        while (line_counter < v_length && line_counter < output_line + NUM_LINE_BUFFERS) {
+            if (line_counter > output_line + 2 && ram.is_busy()) break;
+
+            read_two_lines(read_slot);
+            line_counter += 2;
+            if (++read_slot == NUM_LINE_BUFFER_PAIRS) read_slot = 0;
+        }
+        if (line_counter != first_line_read) line_read_in_flight = true;
+
+        if (line_counter == output_line + 2 && line_read_in_flight) {
+            uint32_t phase_start = start_phase();
+            ram.wait_for_finish_blocking();
+            diags.ram_wait_time += end_phase(phase_start);
+            line_read_in_flight = false;
+        }
+
+        // Once all the lines have been read there is nothing left to be ahead of
+        if (line_counter < v_length) {
+            uint32_t pairs_ahead = ((line_counter - output_line) >> 1) - 1;
+            if (pairs_ahead > 0 && ram.is_busy()) --pairs_ahead;
+            min_ahead = std::min(min_ahead, pairs_ahead);
+        }
+
+        // Sprites starting on this pair must be loaded now.  If all the TMDS buffers are
+        // full we are well ahead of the output, so use the time to load the next sprites.
+        load_deferred_sprites(output_line);
+        while (queue_is_empty(&dvi0.q_tmds_free) && load_next_deferred_sprite(output_line)) {}
+
+        // Then run blitter commands, until the last pair when the RAM may be handed back.
+        // A command can span several frames, so they only run when the app isn't switching banks.
+        if (single_bank_mode) {
+            while (output_line + 2 < v_length && queue_is_empty(&dvi0.q_tmds_free) && blitter.step()) {}
         }
         else {
+            blitter.discard();
+        }
+
+        if (output_line + 2 >= v_length) {
             // We are done reading RAM, indicate RAM bank can be switched
             if (spi_mode) {
                 ram.set_spi();
@@ -395,31 +528,74 @@ void DisplayDriver::main_loop() {
             gpio_put(PIN_VSYNC, 1);
         }
 
-        // Flip the buffer index to the one read last time, which is now ready to output
-        pixel_data_read_idx ^= 1;
+        const bool core0_line_valid = output_line + 1 < v_length;
+        const bool late = is_line_pair_late();
 
+        uint32_t sync_start = time_us_32();
+        uint32_t sync_time = 0;
         uint32_t *core0_tmds_buf = nullptr, *core1_tmds_buf;
+        uint32_t phase_start = start_phase();
         queue_remove_blocking_u32(&dvi0.q_tmds_free, &core1_tmds_buf);
-        sio_hw->fifo_wr = (line_counter - 2) | (line_mode[pixel_data_read_idx * 2] << 24);
-        sio_hw->fifo_wr = uint32_t(pixel_ptr[pixel_data_read_idx * 2]);
-        sio_hw->fifo_wr = uint32_t(core1_tmds_buf);
-        __sev();
+        diags.fifo_wait_time += end_phase(phase_start);
+        push_line_to_core1(output_line, pixel_ptr[output_slot * 2], core1_tmds_buf, line_mode[output_slot * 2], late);
 
-        if (line_counter < frame_data.config.v_length + 1) {
-            uint32_t* core0_colour_buf = pixel_ptr[pixel_data_read_idx * 2 + 1];
+        if (core0_line_valid) {
+            uint32_t* core0_colour_buf = pixel_ptr[output_slot * 2 + 1];
 
+            phase_start = start_phase();
             queue_remove_blocking_u32(&dvi0.q_tmds_free, &core0_tmds_buf);
-            prepare_scanline_core0(line_counter - 1, core0_colour_buf, core0_tmds_buf, line_mode[pixel_data_read_idx * 2 + 1]);
+            diags.fifo_wait_time += end_phase(phase_start);
+            sync_time = time_us_32() - sync_start;
+            prepare_scanline_core0(output_line + 1, core0_colour_buf, core0_tmds_buf, line_mode[output_slot * 2 + 1], late);
+            sync_start = time_us_32();
+        }
+
+        // In single bank mode, once all the lines and sprites for this frame have been read the
+        // PSRAM is free, so read the next frame's headers and start the frame table read now.
+        if (single_bank_mode && !spi_mode && !next_frame_started && line_counter >= v_length &&
+            next_deferred_sprite == num_deferred_sprites && !ram.is_busy())
+        {
+            if (frame_header_callback) frame_header_callback();
+            next_frame_started = start_next_frame();
+            line_read_in_flight = false;
         }
 
-        multicore_fifo_pop_blocking();
+        wait_for_core1_line();
         queue_add_blocking_u32(&dvi0.q_tmds_valid, &core1_tmds_buf);
-        if (line_counter < frame_data.config.v_length + 1) {
+        if (core0_line_valid) {
             queue_add_blocking_u32(&dvi0.q_tmds_valid, &core0_tmds_buf);
         }
+        diags.scanline_total_sync_time[0] += sync_time + (time_us_32() - sync_start);
 
-        line_counter += 2;
+        if (++output_slot == NUM_LINE_BUFFER_PAIRS) output_slot = 0;
     }
+
+    diags.line_read_min_ahead = min_ahead;
+}
+
+void DisplayDriver::push_line_to_core1(int line_number, uint32_t* colour_buf, uint32_t* tmds_buf, int8_t scanline_mode, bool late) {
+    const uint32_t write_idx = line_ring_write_idx;
+
+    // Core 0 waits for each line before pushing another, so this should never wait.
+    while (write_idx - line_ring_done_idx >= LINE_RING_SIZE) __wfe();
+
+    LineDescriptor& desc = line_ring[write_idx & (LINE_RING_SIZE - 1)];
+    desc.colour_buf = colour_buf;
+    desc.tmds_buf = tmds_buf;
+    desc.line_number = line_number;
+    desc.line_mode = scanline_mode;
+    desc.late = late;
+    desc.publish_time = time_us_32();
+
+    // Descriptor must be visible to core 1 before the index is updated
+    __dmb();
+    line_ring_write_idx = write_idx + 1;
+    __sev();
+}
+
+void DisplayDriver::wait_for_core1_line() {
+    while (line_ring_done_idx != line_ring_write_idx) __wfe();
+    __dmb();
 }
 
 void DisplayDriver::set_sprite(int8_t i, int16_t idx, BlendMode mode, int16_t x, int16_t y, uint8_t v_scale) {
@@ -443,86 +619,166 @@ void DisplayDriver::clear_late_scanlines() {
     dvi0.total_late_scanlines = 0;
 }
 
-void DisplayDriver::prepare_scanline_core0(int line_number, uint32_t* pixel_data, uint32_t* tmds_buf, int scanline_mode) {
+bool DisplayDriver::is_line_pair_late() {
+    if (!overload_policy_enabled) return false;
+
+    // Nothing can be late until active scan out starts, the queue is empty at the start of the frame
+    if (dvi0.timing_state.v_state != DVI_STATE_ACTIVE) return false;
+
+    // The queue level is read without taking the lock, it only needs to be approximately right.
+    return queue_get_level_unsafe(&dvi0.q_tmds_valid) < OVERLOAD_MIN_QUEUED_LINES;
+}
+
+void DisplayDriver::prepare_scanline_core0(int line_number, uint32_t* pixel_data, uint32_t* tmds_buf, int scanline_mode, bool late) {
     uint32_t start = time_us_32();
 
+    const int max_patches = late ? overload_max_patches : MAX_PATCHES_PER_LINE;
+    if (late) ++diags.degraded_lines[0];
+    uint32_t phase_start = start;
+
     int i;
     for (i = 0; i < MAX_PATCHES_PER_LINE; ++i) {
-        if (patches[line_number][i].data) {
-            if (scanline_mode & (RGB888 | PALETTE)) Sprite::apply_blend_patch_byte_x(patches[line_number][i], (uint8_t*)pixel_data);
-            else Sprite::apply_blend_patch_555_y(patches[line_number][i], (uint8_t*)pixel_data);
-            patches[line_number][i].data = nullptr;
+        Sprite::BlendPatch& patch = patches[line_number][i];
+        if (patch.data) {
+            if (i >= max_patches) {
+                ++diags.degraded_patches_skipped[0];
+            }
+            else {
+                if (late && overload_simplify_blend && patch.mode == BLEND_BLEND) {
+                    patch.mode = BLEND_DEPTH2;
+                    ++diags.degraded_blends[0];
+                }
+                if (scanline_mode & (RGB888 | PALETTE)) Sprite::apply_blend_patch_byte_x(patch, (uint8_t*)pixel_data);
+                else Sprite::apply_blend_patch_555_y(patch, (uint8_t*)pixel_data);
+            }
+            patch.data = nullptr;
         }
         else {
             break;
         }
     }
+    diags.patch_time[0] += end_phase(phase_start);
+
     if (scanline_mode & DOUBLE_PIXELS) {
-        if ((scanline_mode & (PALETTE | RGB888)) == (PALETTE | RGB888)) tmds_encode_palette_data(pixel_data, tmds_doubled_palette256_lut, tmds_buf, frame_data.config.h_length >> 1, 0, 8);
-        else if (scanline_mode & RGB888) tmds_encode_24bpp(pixel_data, tmds_buf, frame_data.config.h_length >> 1);
-        else if (scanline_mode & PALETTE) tmds_encode_palette_data(pixel_data, tmds_doubled_palette_lut, tmds_buf, frame_data.config.h_length >> 1, 2, 5);
-        else tmds_encode_15bpp(pixel_data, tmds_buf, frame_data.config.h_length >> 1);
+        if ((scanline_mode & (PALETTE | RGB888)) == (PALETTE | RGB888)) tmds_encode_palette_data(pixel_data, tmds_doubled_palette256_lut, tmds_buf, output_h_length >> 1, 0, 8);
+        else if (scanline_mode & RGB888) tmds_encode_24bpp(pixel_data, tmds_buf, output_h_length >> 1);
+        else if (scanline_mode & PALETTE) tmds_encode_palette_data(pixel_data, tmds_doubled_palette_lut, tmds_buf, output_h_length >> 1, 2, 5);
+        else tmds_encode_15bpp(pixel_data, tmds_buf, output_h_length >> 1);
     }
-    else if (scanline_mode & PALETTE) tmds_encode_fullres_palette(pixel_data, tmds_palette_luts, tmds_buf, frame_data.config.h_length);
-    else tmds_encode_fullres_15bpp(pixel_data, tmds_15bpp_lut, tmds_buf, frame_data.config.h_length);
+    else if (scanline_mode & PALETTE) tmds_encode_fullres_palette(pixel_data, tmds_palette_luts, tmds_buf, output_h_length);
+    else tmds_encode_fullres_15bpp(pixel_data, tmds_15bpp_lut, tmds_buf, output_h_length);
+    diags.encode_time[0] += end_phase(phase_start);
 
     const uint32_t scanline_time = time_us_32() - start;
     diags.scanline_max_prep_time[0] = std::max(scanline_time, diags.scanline_max_prep_time[0]);
     diags.scanline_max_sprites[0] = std::max(uint32_t(i), diags.scanline_max_sprites[0]);
     diags.scanline_total_prep_time[0] += scanline_time;
+    record_line_timing(0, line_number, scanline_mode, i, scanline_time, late);
 }    
 
-void DisplayDriver::prepare_scanline_core1(int line_number, uint32_t* pixel_data, uint32_t* tmds_buf, int scanline_mode) {
+void DisplayDriver::record_line_timing(int core, int line_number, int scanline_mode, int num_patches, uint32_t scanline_time, bool late) {
+    ++line_time_histogram[core][std::min(scanline_time / line_trace.bin_width, uint32_t(LINE_TIME_HISTOGRAM_BINS - 1))];
+
+    if (late || scanline_time >= line_trace.trace_threshold) {
+        const uint8_t idx = line_trace.next_entry[core];
+        LineTraceEntry& entry = line_trace.entries[core][idx];
+        entry.line_number = line_number;
+        entry.line_mode = scanline_mode;
+        entry.num_patches = num_patches;
+        entry.prep_time = std::min(scanline_time, uint32_t(0xFFFF));
+        entry.frame = line_trace.frame;
+        entry.late = late;
+        line_trace.next_entry[core] = (idx + 1) & (LINE_TRACE_LEN - 1);
+    }
+}
+
+void DisplayDriver::prepare_scanline_core1(int line_number, uint32_t* pixel_data, uint32_t* tmds_buf, int scanline_mode, bool late) {
     uint32_t start = time_us_32();
 
+    const int max_patches = late ? overload_max_patches : MAX_PATCHES_PER_LINE;
+    if (late) ++diags.degraded_lines[1];
+    uint32_t phase_start = start;
+
     int i;
     for (i = 0; i < MAX_PATCHES_PER_LINE; ++i) {
-        if (patches[line_number][i].data) {
-            if (scanline_mode & (RGB888 | PALETTE)) Sprite::apply_blend_patch_byte_x(patches[line_number][i], (uint8_t*)pixel_data);
-            else Sprite::apply_blend_patch_555_x(patches[line_number][i], (uint8_t*)pixel_data);
-            patches[line_number][i].data = nullptr;
+        Sprite::BlendPatch& patch = patches[line_number][i];
+        if (patch.data) {
+            if (i >= max_patches) {
+                ++diags.degraded_patches_skipped[1];
+            }
+            else {
+                if (late && overload_simplify_blend && patch.mode == BLEND_BLEND) {
+                    patch.mode = BLEND_DEPTH2;
+                    ++diags.degraded_blends[1];
+                }
+                if (scanline_mode & (RGB888 | PALETTE)) Sprite::apply_blend_patch_byte_x(patch, (uint8_t*)pixel_data);
+                else Sprite::apply_blend_patch_555_x(patch, (uint8_t*)pixel_data);
+            }
+            patch.data = nullptr;
         }
         else {
             break;
         }
     }
+    diags.patch_time[1] += end_phase(phase_start);
+
     if (scanline_mode & DOUBLE_PIXELS) {
-        if ((scanline_mode & (PALETTE | RGB888)) == (PALETTE | RGB888)) tmds_encode_palette_data(pixel_data, tmds_doubled_palette256_lut, tmds_buf, frame_data.config.h_length >> 1, 0, 8);
-        else if (scanline_mode & RGB888) tmds_encode_24bpp(pixel_data, tmds_buf, frame_data.config.h_length >> 1);
-        else if (scanline_mode & PALETTE) tmds_encode_palette_data(pixel_data, tmds_doubled_palette_lut, tmds_buf, frame_data.config.h_length >> 1, 2, 5);
-        else tmds_encode_15bpp(pixel_data, tmds_buf, frame_data.config.h_length >> 1);
+        if ((scanline_mode & (PALETTE | RGB888)) == (PALETTE | RGB888)) tmds_encode_palette_data(pixel_data, tmds_doubled_palette256_lut, tmds_buf, output_h_length >> 1, 0, 8);
+        else if (scanline_mode & RGB888) tmds_encode_24bpp(pixel_data, tmds_buf, output_h_length >> 1);
+        else if (scanline_mode & PALETTE) tmds_encode_palette_data(pixel_data, tmds_doubled_palette_lut, tmds_buf, output_h_length >> 1, 2, 5);
+        else tmds_encode_15bpp(pixel_data, tmds_buf, output_h_length >> 1);
     }
-    else if (scanline_mode & PALETTE) tmds_encode_fullres_palette(pixel_data, tmds_palette_luts, tmds_buf, frame_data.config.h_length);
-    else tmds_encode_fullres_15bpp(pixel_data, tmds_15bpp_lut, tmds_buf, frame_data.config.h_length);
+    else if (scanline_mode & PALETTE) tmds_encode_fullres_palette(pixel_data, tmds_palette_luts, tmds_buf, output_h_length);
+    else tmds_encode_fullres_15bpp(pixel_data, tmds_15bpp_lut, tmds_buf, output_h_length);
+    diags.encode_time[1] += end_phase(phase_start);
 
     const uint32_t scanline_time = time_us_32() - start;
     diags.scanline_max_prep_time[1] = std::max(scanline_time, diags.scanline_max_prep_time[1]);
     diags.scanline_max_sprites[1] = std::max(uint32_t(i), diags.scanline_max_sprites[1]);
     diags.scanline_total_prep_time[1] += scanline_time;
+    record_line_timing(1, line_number, scanline_mode, i, scanline_time, late);
 }    
 
-void DisplayDriver::read_two_lines(uint idx) {
+void DisplayDriver::read_two_lines(uint slot) {
     uint32_t addresses[4];
     uint32_t read_lengths[4];
-    uint32_t* ptr = pixel_data[idx];
+    uint32_t* ptr = pixel_data[slot];
     int address_idx = 0;
+    uint8_t scroll_groups = 0;
+
+    // The cached commands are only used if they were built from the same frame table entries,
+    // so they survive bank flips and reloads of a frame table that hasn't changed.
+    const LinePairReadCmds& cached = line_pair_read_cmds[line_counter >> 1];
+    const bool use_cached_cmds = cached.cmd_len != 0 &&
+                                 cached.entries[0] == frame_table[line_counter].entry &&
+                                 cached.entries[1] == frame_table[line_counter + 1].entry;
 
     for (int i = 0; i < 2; ++i) {
         const FrameTableEntry& entry = frame_table[line_counter + i];
+        pixel_ptr[slot * 2 + i] = ptr;
+
+        const bool double_pixels = (entry.h_repeat() == 2);
+        const uint32_t line_length = frame_data.get_line_data_len(entry);
+        ptr += line_length >> 2;
+
+        int8_t lmode = 0;
+        if (double_pixels) lmode |= DOUBLE_PIXELS;
+        if (entry.line_mode() == MODE_PALETTE256) lmode |= PALETTE | RGB888;
+        else if (entry.line_mode() == MODE_PALETTE) lmode |= PALETTE;
+        else if (entry.line_mode() == MODE_RGB888) lmode |= RGB888;
+        line_mode[slot * 2 + i] = lmode;
+
+        if (use_cached_cmds) continue;
+
         const ScrollConfig& scroll_config = frame_scroll[entry.frame_offset_idx()];
-        
+        scroll_groups |= 1 << entry.frame_offset_idx();
+
         uint32_t addr = entry.line_address() + scroll_config.start_address_offset;
         if (scroll_config.max_start_address > 0 && addr >= scroll_config.max_start_address) {
             addr = entry.line_address() + scroll_config.start_address_offset2;
         }
 
         addresses[address_idx] = addr;
-        pixel_ptr[idx * 2 + i] = ptr;
-
-        const bool double_pixels = (entry.h_repeat() == 2);
-        uint32_t line_length = frame_data.config.h_length * get_pixel_data_len(entry.line_mode());
-        if (double_pixels) line_length >>= 1;
-        ptr += line_length >> 2;
 
         if (scroll_config.wrap_position > 0 && (uint32_t)scroll_config.wrap_position < line_length) {
             read_lengths[address_idx++] = scroll_config.wrap_position;
@@ -532,64 +788,259 @@ void DisplayDriver::read_two_lines(uint idx) {
         else {
             read_lengths[address_idx++] = line_length;
         }
-        
-        int8_t lmode = 0;
-        if (double_pixels) lmode |= DOUBLE_PIXELS;
-        if (entry.line_mode() == MODE_PALETTE256) lmode |= PALETTE | RGB888;
-        else if (entry.line_mode() == MODE_PALETTE) lmode |= PALETTE;
-        else if (entry.line_mode() == MODE_RGB888) lmode |= RGB888;
-        line_mode[idx * 2 + i] = lmode;
     }
 
-    ram.multi_read(addresses, read_lengths, address_idx, pixel_data[idx]);
+    if (use_cached_cmds) {
+        ram.multi_read_cmds(&line_read_cmds[cached.cmd_start], cached.cmd_len, pixel_data[slot], cached.read_len_in_words);
+        return;
+    }
+
+    ram.multi_read(addresses, read_lengths, address_idx, pixel_data[slot]);
+    cache_line_read_cmds(line_counter >> 1, scroll_groups, ptr - pixel_data[slot]);
+}
+
+void DisplayDriver::cache_line_read_cmds(uint32_t pair_idx, uint8_t scroll_groups, uint32_t read_len_in_words) {
+    const uint32_t line = pair_idx << 1;
+    uint32_t num_cmd_words;
+    const uint32_t* cmds = ram.get_multi_read_cmds(num_cmd_words);
+
+    LinePairReadCmds& pair = line_pair_read_cmds[pair_idx];
+    if (num_cmd_words > pair.cmd_capacity) {
+        // Doesn't fit where this pair was before, allocate new space if there is any left
+        if (num_cmd_words > 255 || line_read_cmds_used + num_cmd_words > LINE_READ_CMD_CACHE_WORDS) return;
+        pair.cmd_start = line_read_cmds_used;
+        pair.cmd_capacity = num_cmd_words;
+        line_read_cmds_used += num_cmd_words;
+    }
+
+    memcpy(&line_read_cmds[pair.cmd_start], cmds, num_cmd_words * 4);
+    pair.cmd_len = num_cmd_words;
+    pair.read_len_in_words = read_len_in_words;
+    pair.scroll_groups = scroll_groups;
+    pair.entries[0] = frame_table[line].entry;
+    pair.entries[1] = frame_table[line + 1].entry;
+}
+
+// Called at VSYNC once this frame's scroll is final, drops the cached read commands that
+// no longer match.  Changes to the frame table are caught per pair in read_two_lines.
+void DisplayDriver::validate_line_read_cmds() {
+    if (frame_data.config.h_length != line_read_cmds_h_length ||
+        ram.get_read_cmd_format() != line_read_cmds_format)
+    {
+        line_read_cmds_h_length = frame_data.config.h_length;
+        line_read_cmds_format = ram.get_read_cmd_format();
+        line_read_cmds_used = 0;
+        memset(line_pair_read_cmds, 0, sizeof(line_pair_read_cmds));
+        memcpy(line_read_cmds_scroll, frame_scroll, sizeof(frame_scroll));
+        return;
+    }
+
+    uint8_t scroll_changed = 0;
+    for (int i = 0; i < NUM_SCROLL_GROUPS; ++i) {
+        if (memcmp(&line_read_cmds_scroll[i], &frame_scroll[i], sizeof(ScrollConfig)) != 0) {
+            scroll_changed |= 1 << i;
+            line_read_cmds_scroll[i] = frame_scroll[i];
+        }
+    }
+    if (!scroll_changed) return;
+
+    // Only the pairs using a changed scroll group are rebuilt, in their existing space
+    for (int i = 0; i < (frame_data.config.v_length + 1) >> 1; ++i) {
+        if (line_pair_read_cmds[i].scroll_groups & scroll_changed) {
+            line_pair_read_cmds[i].cmd_len = 0;
+        }
+    }
 }
 
 void DisplayDriver::setup_palette() {
     if (frame_data.frame_table_header.num_palettes == 0) return;
 
-    uint8_t palette[PALETTE_SIZE * 3];
+    alignas(4) uint8_t palette[PALETTE_SIZE * 3];
     frame_data.get_palette(palette_idx, frame_counter, palette);
     ram.wait_for_finish_blocking();
-
-    if (balanced_symbol_luts) {
-        tmds_double_encode_setup_balanced_lut(palette, tmds_palette_luts, 3);
-        tmds_double_encode_setup_balanced_lut(palette + 1, tmds_palette_luts + (PALETTE_SIZE * PALETTE_SIZE * 4), 3);
-        tmds_double_encode_setup_balanced_lut(palette + 2, tmds_palette_luts + (PALETTE_SIZE * PALETTE_SIZE * 8), 3);
-    }
-    else {
-        tmds_double_encode_setup_lut(palette, tmds_palette_luts, 3);
-        tmds_double_encode_setup_lut(palette + 1, tmds_palette_luts + (PALETTE_SIZE * PALETTE_SIZE * 4), 3);
-        tmds_double_encode_setup_lut(palette + 2, tmds_palette_luts + (PALETTE_SIZE * PALETTE_SIZE * 8), 3);
+    apply_colour_cycle(0, palette);
+
+    // Only the LUTs for channels and entries that differ from the last palette are regenerated.
+    // The full resolution LUTs are indexed by pairs of entries and are built by PicoDVI for a whole
+    // channel at once, so a colour cycle step still rebuilds every channel whose values rotated.
+    uint32_t channels_changed = 0;
+    const uint32_t entries_changed = diff_palette(0, palette, channels_changed);
+
+    for (int c = 0; c < 3; ++c) {
+        if (channels_changed & (1 << c)) {
+            uint32_t* lut = tmds_palette_luts + (PALETTE_SIZE * PALETTE_SIZE * 4) * c;
+            if (balanced_symbol_luts) tmds_double_encode_setup_balanced_lut(palette + c, lut, 3);
+            else tmds_double_encode_setup_lut(palette + c, lut, 3);
+        }
     }
-    tmds_setup_palette_symbols(palette, tmds_doubled_palette_lut, PALETTE_SIZE, 32);
+    update_palette_symbols(palette, tmds_doubled_palette_lut, entries_changed, PALETTE_SIZE);
 
     if (frame_data.frame_table_header.num_palettes >= palette_idx + 8) {
         // 256 colour palette (pixel doubled only)
-        tmds_setup_palette_symbols(palette, tmds_doubled_palette256_lut, 32, 256);
+        update_palette_symbols(palette, tmds_doubled_palette256_lut, palette256_lut_valid ? entries_changed : 0xFFFFFFFF, 256);
+        palette256_lut_valid = true;
+
         for (int i = 1; i < 8; ++i) {
             frame_data.get_palette(palette_idx + i, frame_counter, palette);
             ram.wait_for_finish_blocking();
-            tmds_setup_palette_symbols(palette, tmds_doubled_palette256_lut + 32 * i, 32, 256);
+            apply_colour_cycle(i, palette);
+            uint32_t slice_channels_changed = 0;
+            update_palette_symbols(palette, tmds_doubled_palette256_lut + 32 * i, diff_palette(i, palette, slice_channels_changed), 256);
         }
     }
+    else if (entries_changed) {
+        palette256_lut_valid = false;
+    }
+}
+
+void DisplayDriver::advance_colour_cycle() {
+    if (colour_cycle_rate == 0 || colour_cycle_len < 2) return;
+    if (--colour_cycle_countdown > 0) return;
+
+    colour_cycle_countdown = std::abs(colour_cycle_rate);
+    if (colour_cycle_rate > 0) {
+        if (colour_cycle_pos == 0) colour_cycle_pos = colour_cycle_len;
+        --colour_cycle_pos;
+    }
+    else {
+        if (++colour_cycle_pos >= colour_cycle_len) colour_cycle_pos = 0;
+    }
+}
+
+// Rotate the colour cycle range within the palette as it is loaded, the
+// changed entries are then picked up by diff_palette like any other change.
+void DisplayDriver::apply_colour_cycle(int slice, uint8_t* palette) {
+    if (colour_cycle_len < 2 || colour_cycle_pos == 0) return;
+    if (colour_cycle_start / PALETTE_SIZE != slice) return;
+
+    uint8_t* const range_start = palette + (colour_cycle_start % PALETTE_SIZE) * 3;
+    const uint pos = colour_cycle_pos % colour_cycle_len;
+    std::rotate(range_start, range_start + pos * 3, range_start + colour_cycle_len * 3);
+}
+
+// Compare a palette slice with the cached copy the LUTs were generated from, and update the cache.
+// Returns a bit mask of the entries that changed, and sets bits 0-2 of channels_changed for each
+// colour channel that changed.
+uint32_t DisplayDriver::diff_palette(int slice, uint8_t* palette, uint32_t& channels_changed) {
+    uint8_t* cached_palette = palette_cache[slice];
+
+    if (!(palette_cache_valid & (1 << slice))) {
+        memcpy(cached_palette, palette, PALETTE_SIZE * 3);
+        palette_cache_valid |= 1 << slice;
+        channels_changed = 0x7;
+        return 0xFFFFFFFF;
+    }
+
+    uint32_t entries_changed = 0;
+    for (int i = 0; i < PALETTE_SIZE; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            if (palette[i * 3 + c] != cached_palette[i * 3 + c]) {
+                cached_palette[i * 3 + c] = palette[i * 3 + c];
+                entries_changed |= 1u << i;
+                channels_changed |= 1u << c;
+            }
+        }
+    }
+    return entries_changed;
+}
+
+void DisplayDriver::update_palette_symbols(uint8_t* palette, uint32_t* lut, uint32_t entries_changed, int lut_stride) {
+    // Above a few entries it is quicker to regenerate the whole slice in one go
+    if (__builtin_popcount(entries_changed) > PALETTE_SIZE / 4) {
+        tmds_setup_palette_symbols(palette, lut, PALETTE_SIZE, lut_stride);
+        return;
+    }
+
+    while (entries_changed) {
+        const int i = __builtin_ctz(entries_changed);
+        tmds_setup_palette_symbols(palette + i * 3, lut + i, 1, lut_stride);
+        entries_changed &= entries_changed - 1;
+    }
 }
 
 void DisplayDriver::update_sprites() {
     Sprite::clear_sprite_data();
+    num_loaded_sprites = 0;
+    num_deferred_sprites = 0;
+    next_deferred_sprite = 0;
+
     for (int i = 0; i < MAX_SPRITES; ++i) {
-        int16_t sprite_table_idx = sprites[i].get_sprite_table_idx();
-        if (sprite_table_idx < 0) continue;
-
-        bool copied = false;
-        for (int j = 0; j < i; ++j) {
-            if (sprites[j].get_sprite_table_idx() == sprite_table_idx) {
-                sprites[i].copy_sprite(sprites[j]);
-                copied = true;
-                break;
+        sprites[i].latch_settings();
+        if (!sprites[i].is_enabled()) continue;
+
+#if DEFER_SPRITE_LOADING
+        const int16_t first_line = sprites[i].get_sprite_y();
+        if (first_line >= DEFERRED_SPRITE_MIN_LINE) {
+            if (first_line >= frame_data.config.v_length) continue;
+
+            // Keep the deferred sprites sorted by first line
+            int j = num_deferred_sprites++;
+            for (; j > 0 && deferred_sprite_line[j - 1] > first_line; --j) {
+                deferred_sprites[j] = deferred_sprites[j - 1];
+                deferred_sprite_line[j] = deferred_sprite_line[j - 1];
             }
+            deferred_sprites[j] = i;
+            deferred_sprite_line[j] = first_line;
+            continue;
         }
-        
-        if (!copied) sprites[i].update_sprite(frame_data);
-        sprites[i].setup_patches(*this);
+#endif
+
+        load_sprite(i, 0);
     }
+}
+
+void DisplayDriver::load_sprite(int i, int first_line) {
+    // Settings were latched at VSYNC, so deferred sprites are shown as they were then
+    const int16_t sprite_table_idx = sprites[i].get_sprite_table_idx();
+    if (sprite_table_idx < 0) return;
+
+    bool copied = false;
+    for (int j = 0; j < num_loaded_sprites; ++j) {
+        const Sprite& other = sprites[loaded_sprites[j]];
+        if (loaded_sprite_table_idx[j] == sprite_table_idx && other.get_sprite_table_idx() == sprite_table_idx) {
+            sprites[i].copy_sprite(other);
+            copied = true;
+            break;
+        }
+    }
+
+    if (!copied) sprites[i].update_sprite(frame_data);
+    sprites[i].setup_patches(*this, i, first_line);
+
+    loaded_sprite_table_idx[num_loaded_sprites] = sprite_table_idx;
+    loaded_sprites[num_loaded_sprites++] = i;
+}
+
+// Set up the patches for the sprites loaded last frame again, using the sprite data already in
+// memory.  Sprites that have been disabled or changed to a different table entry since are not shown.
+void DisplayDriver::reuse_loaded_sprites() {
+    num_deferred_sprites = 0;
+    next_deferred_sprite = 0;
+
+    for (int j = 0; j < num_loaded_sprites; ++j) {
+        Sprite& sprite = sprites[loaded_sprites[j]];
+        sprite.latch_settings();
+        if (sprite.get_sprite_table_idx() == loaded_sprite_table_idx[j]) {
+            sprite.setup_patches(*this, loaded_sprites[j], 0);
+        }
+    }
+}
+
+// Load any deferred sprites that start on the line pair about to be output
+void DisplayDriver::load_deferred_sprites(int output_line) {
+    while (next_deferred_sprite < num_deferred_sprites && deferred_sprite_line[next_deferred_sprite] <= output_line + 1) {
+        ++diags.sprites_loaded_late;
+        load_next_deferred_sprite(output_line);
+    }
+}
+
+bool DisplayDriver::load_next_deferred_sprite(int first_line) {
+    if (next_deferred_sprite == num_deferred_sprites) return false;
+
+    ++diags.sprites_deferred;
+    load_sprite(deferred_sprites[next_deferred_sprite++], first_line);
+
+    // The sprite data is read asynchronously, and could be needed by the next line pair
+    ram.wait_for_finish_blocking();
+    return true;
 }
\ No newline at end of file
@@ -1,8 +1,10 @@
 #pragma once
 
 #include <map>
+#include <algorithm>
 
 #include "pico/sem.h"
+#include "hardware/timer.h"
 #include "aps6404.hpp"
 extern "C"
 {
@@ -12,6 +14,7 @@ extern "C"
 #include "constants.hpp"
 #include "frame_decode.hpp"
 #include "sprite.hpp"
+#include "blitter.hpp"
 
 class DisplayDriver
 {
@@ -44,6 +47,9 @@ public:
         next_frame_scroll[idx].start_address_offset2 = offset2;
     }
 
+    // Lines using the scroll group are read from the start address up to position bytes, then continue
+    // from offset bytes after that.  A line whose ring is a whole 1KB PSRAM page, so the first part ends
+    // at the end of the page and offset is -1024, is read in one burst at clocks where bursts wrap in a page.
     void set_scroll_wrap(int idx, int16_t position, int16_t offset) {
         next_frame_scroll[idx].wrap_position = position;
         next_frame_scroll[idx].wrap_offset = offset + position;
@@ -59,6 +65,30 @@ public:
         palette_idx = val;
     }
 
+    // Rotate palette entries start to start + len - 1 by one place every abs(rate) frames.
+    // Positive rates move each colour to the next higher entry, 0 disables cycling.
+    // The range must be within one 32 entry palette, if it isn't it is truncated.
+    void set_colour_cycle(uint8_t start, uint8_t len, int8_t rate) {
+        colour_cycle_start = start;
+        colour_cycle_len = std::min(len, uint8_t(PALETTE_SIZE - (start % PALETTE_SIZE)));
+        colour_cycle_rate = rate;
+        colour_cycle_pos = 0;
+        colour_cycle_countdown = 0;
+    }
+
+    // Force the frame table to be read from PSRAM at the next VSYNC, even if the
+    // bank and frame haven't changed.
+    void invalidate_frame_table() { frame_data.invalidate_frame_table(); }
+
+    // Set the PSRAM address of the frame headers, this is latched at the next VSYNC.
+    // This allows multiple frame buffers in one RAM bank, and a flip to be done with
+    // a register write.  If single_bank is set then the app does not switch RAM banks,
+    // so no grace period for a bank switch is needed after VSYNC.
+    void set_header_address(uint32_t address, bool single_bank) {
+        next_header_address = address;
+        single_bank_mode = single_bank;
+    }
+
     // Called internally by run().
     void run_core1();
 
@@ -70,6 +100,26 @@ public:
         uint32_t scanline_total_prep_time[2] = {0, 0};
         uint32_t scanline_max_prep_time[2] = {0, 0};
         uint32_t scanline_max_sprites[2] = {0, 0};
+        uint32_t scanline_total_sync_time[2] = {0, 0};  // Time spent handing lines between the cores
+        uint32_t line_read_min_ahead = 0;  // Fewest line pairs that had been read beyond the pair being output
+        uint32_t line_read_stalls = 0;     // Number of line pairs that weren't read by the time they were needed
+        uint32_t degraded_lines[2] = {0, 0};            // Lines prepared under the overload policy
+        uint32_t degraded_patches_skipped[2] = {0, 0};  // Blend patches not applied because the line was late
+        uint32_t degraded_blends[2] = {0, 0};           // BLEND_BLEND patches applied as BLEND_DEPTH2 because the line was late
+        uint32_t sprites_deferred = 0;     // Sprites loaded in idle time during the active lines instead of at VSYNC
+        uint32_t sprites_loaded_late = 0;  // Deferred sprites that had to be loaded because their first line was reached
+        uint32_t blits_completed = 0;      // Total blitter commands finished
+        uint32_t blits_rejected = 0;       // Blitter commands dropped or invalid since last cleared
+        uint32_t header_failures = 0;      // Frames whose headers failed their check
+        // Phase timings, only gathered when phase profiling is enabled
+        uint32_t fifo_wait_time = 0;          // Core 0 waiting for free TMDS buffers
+        uint32_t ram_wait_time = 0;           // Core 0 waiting for line reads from PSRAM
+        uint32_t patch_time[2] = {0, 0};      // Applying blend patches
+        uint32_t encode_time[2] = {0, 0};     // TMDS encoding
+        uint32_t vsync_header_time = 0;       // Reading the headers and frame table
+        uint32_t vsync_palette_time = 0;
+        uint32_t vsync_sprite_time = 0;
+        uint32_t vsync_line_read_time = 0;    // Reading the first line pair
         uint32_t vsync_time = 0;
         uint32_t peak_scanline_time = 0;
         uint32_t total_late_scanlines = 0;
@@ -81,9 +131,40 @@ public:
     void clear_peak_scanline_time() { diags.peak_scanline_time = 0; }
     void clear_late_scanlines();
 
+    // Line timing trace, readable over I2C through the paged window.
+    // Each core keeps a ring of its recent lines that were late or took at least trace_threshold to prepare.
+    // Over I2C page 0 is core 0's ring, page 1 is core 1's ring and page 2 is the histogram.
+    static constexpr int LINE_TRACE_LEN = 16;
+    static constexpr int LINE_TIME_HISTOGRAM_BINS = 16;
+    struct LineTraceEntry {
+        uint16_t line_number;
+        int8_t line_mode;
+        uint8_t num_patches;
+        uint16_t prep_time;  // us
+        uint8_t frame;       // Low byte of LineTrace::frame when the line was prepared
+        uint8_t late;        // Whether the overload policy flagged the line as late
+    };
+    struct LineTrace {
+        LineTraceEntry entries[2][LINE_TRACE_LEN];
+        uint16_t histogram[LINE_TIME_HISTOGRAM_BINS];  // Lines in the last frame by prep time, the last bin includes all longer lines
+        uint16_t bin_width;        // us
+        uint16_t trace_threshold;  // us
+        uint16_t frame;            // Incremented each frame
+        uint8_t next_entry[2];     // Next entry each core will write
+    };
+    const LineTrace& get_line_trace() const { return line_trace; }
+
     // Set this callback to get diags info each frame before it is cleared
     void (*diags_callback)(const Diags&) = nullptr;
 
+    // Set this callback to apply changes queued by interrupts.  It is called at the start of each VSYNC.
+    void (*vsync_callback)() = nullptr;
+
+    // Set this callback to apply queued changes to the header address, frame table, palette index and frame counter.
+    // It is called before the next frame's headers are read if that is done during the last lines of a frame,
+    // so it must not do anything else.
+    void (*frame_header_callback)() = nullptr;
+
     // Defaults to QPI.  If use_spi true then RAM set back to SPI mode for VSYNC.
     void set_spi_mode(bool use_spi) { spi_mode = use_spi; }
 
@@ -92,10 +173,41 @@ public:
     void enable_balanced_luts(bool enable) {
         balanced_symbol_luts = enable;
         luts_inited = false;
+        palette_cache_valid = 0;
+        palette256_lut_valid = false;
     }
 
     void stop() { stop_display = true; }
 
+    // Policy for lines that start too late to be prepared in time:
+    //  Bit 7: Enable the policy
+    //  Bit 6: Apply BLEND_BLEND patches as the cheaper BLEND_DEPTH2
+    //  Bits 0-3: Maximum number of blend patches to apply, later patches on the line are skipped
+    // Each degradation is counted in the diags.
+    void set_overload_policy(uint8_t policy) {
+        overload_max_patches = std::min(policy & 0xF, MAX_PATCHES_PER_LINE);
+        overload_simplify_blend = (policy & 0x40) != 0;
+        overload_policy_enabled = (policy & 0x80) != 0;
+    }
+
+    // Gather the phase timings in the diags.  This adds a little overhead to every line.
+    void set_phase_profiling(bool enable) { profile_phases = enable; }
+
+    // Checking of the frame headers at each VSYNC.  If checksum is set the headers must be followed by
+    // a checksum word, see FrameFormat.txt.  If keep_last_good is set a frame whose headers fail the
+    // check is shown with the headers, frame table, palettes and sprites of the last good frame,
+    // otherwise the display stops.  Failures are counted in the diags.
+    void set_header_check(bool checksum, bool keep_last_good) {
+        frame_data.set_header_checksum(checksum);
+        keep_last_good_frame = keep_last_good;
+    }
+
+    // Queue a blitter command, see blitter.hpp.  The commands run when the PSRAM is free during
+    // the active lines, on the RAM bank being displayed.  May be called from an interrupt.
+    // Commands only run in single bank mode, otherwise they are discarded and counted as rejected.
+    bool queue_blit(const uint8_t* cmd) { return blitter.queue_command(cmd); }
+    void clear_blits_rejected() { blitter.clear_num_rejected(); }
+
 private:
     friend class Sprite;
 
@@ -106,14 +218,38 @@ private:
     };
 
     void main_loop();
-    void prepare_scanline_core0(int line_number, uint32_t *pixel_data, uint32_t *tmds_buf, int scanline_mode);
-    void prepare_scanline_core1(int line_number, uint32_t *pixel_data, uint32_t *tmds_buf, int scanline_mode);
-    void read_two_lines(uint idx);
+    void push_line_to_core1(int line_number, uint32_t* colour_buf, uint32_t* tmds_buf, int8_t scanline_mode, bool late);
+    void wait_for_core1_line();
+    bool start_next_frame();
+    bool is_line_pair_late();
+    void prepare_scanline_core0(int line_number, uint32_t *pixel_data, uint32_t *tmds_buf, int scanline_mode, bool late);
+    void prepare_scanline_core1(int line_number, uint32_t *pixel_data, uint32_t *tmds_buf, int scanline_mode, bool late);
+    uint32_t start_phase() const { return profile_phases ? time_us_32() : 0; }
+    uint32_t end_phase(uint32_t& phase_start) const {
+        if (!profile_phases) return 0;
+        const uint32_t now = time_us_32();
+        const uint32_t phase_time = now - phase_start;
+        phase_start = now;
+        return phase_time;
+    }
+    void record_line_timing(int core, int line_number, int scanline_mode, int num_patches, uint32_t scanline_time, bool late);
+    void read_two_lines(uint slot);
+    void validate_line_read_cmds();
+    void cache_line_read_cmds(uint32_t pair_idx, uint8_t scroll_groups, uint32_t read_len_in_words);
     void setup_palette();
+    void advance_colour_cycle();
+    void apply_colour_cycle(int slice, uint8_t* palette);
+    uint32_t diff_palette(int slice, uint8_t* palette, uint32_t& channels_changed);
+    void update_palette_symbols(uint8_t* palette, uint32_t* lut, uint32_t entries_changed, int lut_stride);
     void clear_patches();
     void update_sprites();
+    void load_sprite(int i, int first_line);
+    void reuse_loaded_sprites();
+    void load_deferred_sprites(int output_line);
+    bool load_next_deferred_sprite(int first_line);
 
     FrameDecode frame_data;
+    Blitter blitter;
     pico_stick::Resolution current_res;
 
     pimoroni::APS6404 ram;
@@ -121,9 +257,15 @@ private:
     struct semaphore dvi_start_sem;
 
     uint8_t last_bank = 2;
+    uint32_t last_header_address = 0;
+    volatile uint32_t next_header_address = 0;
+    bool single_bank_mode = false;
+    bool keep_last_good_frame = false;
     int frames_to_next_count = 0;
     int frame_counter = 0;
     int line_counter = 0;
+    int output_h_length = 0;  // Width of the frame being output, frame_data may already have the next frame's headers
+    bool next_frame_started = false;  // Whether start_next_frame has been called for the next frame
     int palette_idx = 0;
 
     struct ScrollConfig {
@@ -138,6 +280,23 @@ private:
     ScrollConfig frame_scroll[NUM_SCROLL_GROUPS] = {0};
     ScrollConfig next_frame_scroll[NUM_SCROLL_GROUPS] = {0};
 
+    // PSRAM read commands for each line pair, kept while the pair's frame table entries, h length
+    // and the scroll of the groups the pair uses are unchanged.  cmd_len of 0 means not cached.
+    struct LinePairReadCmds {
+        uint32_t entries[2];    // The frame table entries the commands were built from
+        uint16_t cmd_start;     // Index into line_read_cmds
+        uint8_t cmd_len;
+        uint8_t cmd_capacity;   // Words allocated at cmd_start, so the pair can be rebuilt in place
+        uint16_t read_len_in_words;
+        uint8_t scroll_groups;  // Bit mask of the scroll groups used by the pair
+    };
+    LinePairReadCmds line_pair_read_cmds[MAX_FRAME_HEIGHT / 2] = {};
+    uint32_t line_read_cmds[LINE_READ_CMD_CACHE_WORDS];
+    uint32_t line_read_cmds_used = 0;
+    uint16_t line_read_cmds_h_length = 0;
+    uint32_t line_read_cmds_format = 0;
+    ScrollConfig line_read_cmds_scroll[NUM_SCROLL_GROUPS] = {0};
+
     // Must be as long as the greatest supported frame height.
     pico_stick::FrameTableEntry* frame_table;
 
@@ -145,12 +304,39 @@ private:
     Sprite::BlendPatch patches[MAX_FRAME_HEIGHT][MAX_PATCHES_PER_LINE];
 
     // Must be long enough to accept two lines plus one padding word at maximum data length and maximum width
-    uint32_t pixel_data[NUM_LINE_BUFFERS / 2][((MAX_FRAME_WIDTH + 1) * 3) / 2];
+    // The buffers are used as a ring of line pairs, line_counter is the next line to read.
+    uint32_t pixel_data[NUM_LINE_BUFFER_PAIRS][((MAX_FRAME_WIDTH + 1) * 3) / 2];
     uint32_t* pixel_ptr[NUM_LINE_BUFFERS];
     int8_t line_mode[NUM_LINE_BUFFERS];
 
+    // Lines for core 1 to prepare are passed through a single producer, single consumer ring.
+    // Core 0 only writes line_ring_write_idx, core 1 only writes line_ring_done_idx.
+    struct LineDescriptor {
+        uint32_t* colour_buf;  // nullptr tells core 1 to stop
+        uint32_t* tmds_buf;
+        uint32_t publish_time;
+        int16_t line_number;
+        int8_t line_mode;
+        bool late;
+    };
+    static constexpr int LINE_RING_SIZE = 4;
+    LineDescriptor line_ring[LINE_RING_SIZE];
+    volatile uint32_t line_ring_write_idx = 0;
+    volatile uint32_t line_ring_done_idx = 0;
+
     Sprite sprites[MAX_SPRITES];
 
+    // Sprites starting this far down the frame are not loaded at VSYNC, instead they are
+    // loaded while core 0 is waiting for a free TMDS buffer, or just before their first line.
+    static constexpr int DEFERRED_SPRITE_MIN_LINE = 32;
+    uint8_t deferred_sprites[MAX_SPRITES];      // Sprite indices, in order of first line
+    int16_t deferred_sprite_line[MAX_SPRITES];
+    int num_deferred_sprites = 0;
+    int next_deferred_sprite = 0;
+    uint8_t loaded_sprites[MAX_SPRITES];        // Sprites loaded this frame, in load order
+    int16_t loaded_sprite_table_idx[MAX_SPRITES];  // Sprite table index each loaded sprite was loaded from
+    int num_loaded_sprites = 0;
+
     // Palette TMDS symbol look up tables
     uint32_t tmds_palette_luts[PALETTE_SIZE * PALETTE_SIZE * 12];
     uint32_t* tmds_15bpp_lut = &tmds_palette_luts[PALETTE_SIZE * PALETTE_SIZE * 2];
@@ -159,11 +345,27 @@ private:
     uint32_t tmds_doubled_palette_lut[PALETTE_SIZE * 3];
     uint32_t tmds_doubled_palette256_lut[256 * 3];
 
+    // The palettes the TMDS LUTs were last generated from, so only changed entries need to be regenerated.
+    // Slice 0 is the 32 colour palette, slices 0-7 make up the 256 colour palette.
+    uint8_t palette_cache[8][PALETTE_SIZE * 3];
+    uint8_t palette_cache_valid = 0;  // Bit mask of valid slices
+    bool palette256_lut_valid = false;  // Whether slice 0 of the 256 colour LUT matches palette_cache[0]
+
+    // Colour cycling, see set_colour_cycle.  colour_cycle_pos is the current left rotation of the range.
+    uint8_t colour_cycle_start = 0;
+    uint8_t colour_cycle_len = 0;
+    int8_t colour_cycle_rate = 0;
+    uint8_t colour_cycle_pos = 0;
+    int colour_cycle_countdown = 0;
+
     // TMDS buffers.  Better to have them here than rely on dynamic allocation
     uint32_t tmds_buffers[NUM_TMDS_BUFFERS * 3 * MAX_FRAME_WIDTH / DVI_SYMBOLS_PER_WORD];
 
     Diags diags;
 
+    LineTrace line_trace = {};
+    uint16_t line_time_histogram[2][LINE_TIME_HISTOGRAM_BINS] = {};  // Gathered by each core during the frame
+
     // Whether the RAM should be in SPI mode for the app processor
     bool spi_mode = false;
 
@@ -179,4 +381,14 @@ private:
 
     // Whether to use balanced symbols for extra device compatability
     bool balanced_symbol_luts = false;
+
+    // Overload policy, see set_overload_policy
+    // A line pair is considered late if fewer than this many encoded lines are queued for output when it starts
+    static constexpr uint OVERLOAD_MIN_QUEUED_LINES = 2;
+    bool overload_policy_enabled = false;
+    bool overload_simplify_blend = false;
+    int overload_max_patches = MAX_PATCHES_PER_LINE;
+
+    // Whether to gather phase timings, see set_phase_profiling
+    bool profile_phases = false;
 };
\ No newline at end of file
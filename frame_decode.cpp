@@ -11,9 +11,9 @@ namespace {
 }
 
 bool FrameDecode::read_headers() {
-    uint32_t buffer[headers_len_in_words];
+    uint32_t buffer[headers_len_in_words + 1];
 
-    ram.read_blocking(0, buffer, headers_len_in_words);
+    ram.read_blocking(header_address, buffer, headers_len_in_words + (header_checksum ? 1 : 0));
 
     if (buffer[0] != 0x4F434950) {
         // Magic word wrong.
@@ -21,6 +21,17 @@ bool FrameDecode::read_headers() {
         return false;
     }
 
+    if (header_checksum) {
+        uint32_t sum = 0;
+        for (int i = 0; i < headers_len_in_words; ++i) {
+            sum += buffer[i];
+        }
+        if (buffer[headers_len_in_words] != ~sum) {
+            // Headers are being updated, or corrupt.
+            return false;
+        }
+    }
+
     memcpy(&config, buffer + 1, sizeof(Config));
     memcpy(&frame_table_header, buffer + 1 + sizeof(Config) / 4, sizeof(FrameTableHeader));
 
@@ -30,7 +41,22 @@ bool FrameDecode::read_headers() {
 void FrameDecode::get_frame_table(int frame_counter, FrameTableEntry* frame_table) {
     uint32_t address = get_frame_table_address() + frame_counter * frame_table_header.frame_table_length;
 
-    ram.read_blocking(address, (uint32_t*)frame_table, frame_table_header.frame_table_length);
+    if (frame_table_valid &&
+        frame_table_tag.dest == frame_table &&
+        frame_table_tag.address == address &&
+        frame_table_tag.length == frame_table_header.frame_table_length &&
+        frame_table_tag.bank_number == frame_table_header.bank_number)
+    {
+        return;
+    }
+
+    frame_table_valid = true;
+    ram.read(address, (uint32_t*)frame_table, frame_table_header.frame_table_length);
+
+    frame_table_tag.dest = frame_table;
+    frame_table_tag.address = address;
+    frame_table_tag.length = frame_table_header.frame_table_length;
+    frame_table_tag.bank_number = frame_table_header.bank_number;
 }
 
 void FrameDecode::get_palette(int idx, int frame_counter, uint8_t palette[PALETTE_SIZE * 3]) {
@@ -76,11 +102,11 @@ uint32_t FrameDecode::get_sprite(int idx, const pico_stick::SpriteHeader& sprite
 }
 
 uint32_t FrameDecode::get_frame_table_address() {
-    return headers_len_in_bytes;
+    return header_address + headers_len_in_bytes + (header_checksum ? 4 : 0);
 }
 
 uint32_t FrameDecode::get_palette_table_address() {
-    return headers_len_in_bytes + frame_table_header.num_frames * frame_table_header.frame_table_length * 4;
+    return get_frame_table_address() + frame_table_header.num_frames * frame_table_header.frame_table_length * 4;
 }
 
 uint32_t FrameDecode::get_sprite_table_address() {
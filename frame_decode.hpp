@@ -12,12 +12,36 @@ class FrameDecode {
             : ram(aps6404)
         {}
 
-        // Read the headers from PSRAM.  Returns false if PSRAM contents is invalid
+        // Set the PSRAM address of the headers, allowing multiple frames to be held in one RAM bank.
+        // The frame table, palette table and sprite table follow the headers.  Must be a multiple of 4.
+        void set_header_address(uint32_t address) { header_address = address & 0x7FFFFC; }
+        uint32_t get_header_address() const { return header_address; }
+
+        // If enabled a checksum word follows the frame table header, and the frame tables follow that.
+        // The checksum is the bitwise inverse of the 32-bit sum of the 7 words from the magic word to
+        // the end of the frame table header.
+        void set_header_checksum(bool enable) { header_checksum = enable; }
+
+        // Read the headers from PSRAM.  Returns false if PSRAM contents is invalid,
+        // config and frame_table_header are then left unchanged.
         bool read_headers();
 
-        // Fill the frame table from PSRAM, frame_table is an array of at least config.v_length
+        // Start filling the frame table from PSRAM, frame_table is an array of at least config.v_length.
+        // The read completes asynchronously, wait for the RAM before using the table.
+        // The read is skipped if the table in frame_table is already for this bank, header address and frame,
+        // unless invalidate_frame_table() has been called since it was read.
         void get_frame_table(int frame_counter, pico_stick::FrameTableEntry* frame_table);
 
+        // Force the next get_frame_table to read from PSRAM, for when the app has modified the frame table
+        void invalidate_frame_table() { frame_table_valid = false; }
+
+        // Length in bytes of the pixel data read for a line
+        uint32_t get_line_data_len(const pico_stick::FrameTableEntry& entry) const {
+            uint32_t line_length = config.h_length * pico_stick::get_pixel_data_len(entry.line_mode());
+            if (entry.h_repeat() == 2) line_length >>= 1;
+            return line_length;
+        }
+
         // Fill a palette
         void get_palette(int idx, int frame_counter, uint8_t palette[PALETTE_SIZE * 3]);
 
@@ -38,5 +62,17 @@ class FrameDecode {
         uint32_t get_sprite_table_address();
 
         pimoroni::APS6404& ram;
+        uint32_t header_address = 0;
+        bool header_checksum = false;
+
+        // Identifies the frame table last read by get_frame_table
+        struct FrameTableTag {
+            pico_stick::FrameTableEntry* dest;
+            uint32_t address;
+            uint16_t length;
+            uint8_t bank_number;
+        } frame_table_tag;
+        volatile bool frame_table_valid = false;
+
         uint32_t buffer[(MAX_SPRITE_HEIGHT >> 1) + 1];
 };
@@ -4,6 +4,7 @@
 #include "i2c_slave.h"
 #include "pico/stdlib.h"
 #include "hardware/gpio.h"
+#include "hardware/dma.h"
 #include "hardware/structs/usb.h"
 
 #include "constants.hpp"
@@ -12,13 +13,21 @@
 
 namespace {
     constexpr uint I2C_SLAVE_ADDRESS = 0x0d;
+    // The SDA hold time and spike filter are set from the baud rate and the system clock,
+    // so the interface is initialised again after each system clock change.
     constexpr uint I2C_BAUDRATE = 400000;
+    constexpr uint I2C_FAST_MODE_PLUS_BAUDRATE = 1000000;
 
     constexpr i2c_inst_t* I2C_INSTANCE = i2c1;
 
     constexpr uint I2C_SPRITE_REG_BASE = 0;
     constexpr uint I2C_SPRITE_DATA_LEN = 7;
 
+    // Each register in the sprite position window is the x and y of a sprite, bytes 3-6 of its sprite data
+    constexpr uint I2C_SPRITE_POS_REG_BASE = 0x50;
+    constexpr uint I2C_SPRITE_POS_DATA_LEN = 4;
+    constexpr uint I2C_SPRITE_POS_OFFSET = 3;
+
     constexpr uint I2C_SCROLL_GROUP_REG_BASE = 0xE0;
     constexpr uint I2C_SCROLL_GROUP_DATA_LEN = 13;
 
@@ -28,6 +37,24 @@ namespace {
     constexpr uint I2C_GPIO_HI_INPUT_REG = 0xC8;
     constexpr uint I2C_EDID_REGISTER = 0xFB;
 
+    // Reading the paged window register streams the 128 byte page selected by the page select register
+    constexpr uint I2C_PAGED_WINDOW_REGISTER = 0xA0;
+    constexpr uint I2C_PAGE_SELECT_REG = 0xCE;
+    constexpr uint I2C_PAGE_LEN = 128;
+
+    // Writes to the blit command register are passed to the blit callback each time a whole command is written
+    constexpr uint I2C_BLIT_COMMAND_REGISTER = 0xA2;
+    constexpr uint I2C_BLIT_COMMAND_LEN = 20;
+
+    // Writes to the bulk sprite register move up to 32 sprites in one transfer, see i2c_interface.hpp
+    constexpr uint I2C_BULK_SPRITE_REGISTER = 0xA4;
+    constexpr uint I2C_BULK_SPRITE_HEADER_LEN = 5;
+    constexpr uint I2C_BULK_SPRITE_MAX_LEN = I2C_BULK_SPRITE_HEADER_LEN + 32 * 4;
+
+    // Reading the snapshot register streams the last snapshot published, a whole read always comes from one snapshot
+    constexpr uint I2C_SNAPSHOT_REGISTER = 0xA8;
+    constexpr uint I2C_SNAPSHOT_MAX_LEN = 128;
+
     // Callback made after an I2C write to high registers is complete.  It gives the first register written,
     // The last register written, a pointer to the memory representing all high registers (from 0xC0), and a pointer to the scroll group memory
     void (*i2c_reg_written_callback)(uint8_t, uint8_t, uint8_t*, uint8_t*) = nullptr;
@@ -37,6 +64,28 @@ namespace {
     // holding all of the sprite info.
     void (*i2c_sprite_written_callback)(uint8_t, uint8_t, uint8_t*) = nullptr;
 
+    // Callback made after sprites are moved through the sprite position window or the bulk sprite register,
+    // with the same arguments as the sprite callback.  The sprite callback is made instead if it isn't set.
+    void (*i2c_sprite_moved_callback)(uint8_t, uint8_t, uint8_t*) = nullptr;
+
+    // Data readable through the paged window
+    const uint8_t* paged_window_data = nullptr;
+    uint32_t paged_window_len = 0;
+
+    // Blit command being written, kept out of the I2C context as USB RAM is full
+    uint8_t blit_command[I2C_BLIT_COMMAND_LEN];
+    void (*i2c_blit_command_callback)(const uint8_t*) = nullptr;
+
+    // Bulk sprite write, decoded at the end of the transfer
+    uint8_t bulk_sprite_data[I2C_BULK_SPRITE_MAX_LEN];
+
+    // Snapshots are double buffered, a new snapshot is written to the buffer that isn't current.
+    // The buffer being read is latched at the start of the read and is not written until it finishes.
+    uint8_t snapshot_data[2][I2C_SNAPSHOT_MAX_LEN];
+    uint8_t snapshot_len = 0;
+    volatile uint8_t snapshot_current = 0;
+    volatile int8_t snapshot_reading = -1;  // -1 if no read in progress
+
     // To write a series of bytes, the master first
     // writes the memory address, followed by the data. The address is automatically incremented
     // for each byte transferred, looping back to 0 upon reaching the end. Reading is done
@@ -53,6 +102,92 @@ namespace {
         bool data_written;
     } context __attribute__((section(".usb_ram.i2c_context")));
 
+    // Writes to the sprite, scroll group and high register memory are moved from the RX FIFO by DMA, so
+    // there are only interrupts for the register address and the stop.  Other registers, and bytes written
+    // past the end of the memory the write started in, are handled a byte at a time.
+    // If DMA isn't requested at init, or there is no DMA channel free, everything is handled a byte at a time.
+    int rx_dma_channel = -1;
+    dma_channel_config rx_dma_config;
+    uint16_t rx_dma_len = 0;     // Length of the DMA for the current write, 0 if there isn't one
+    uint8_t rx_dma_reg_len = 1;  // Bytes per register in the memory being written, 0 for the bulk sprite register
+
+    // Called with the register address just read, starts the DMA if the register is written by DMA
+    void start_rx_dma(i2c_inst_t *i2c, I2CContext* cxt) {
+        if (rx_dma_channel < 0) return;
+
+        const uint reg = cxt->cur_register;
+        uint8_t* dest;
+        if (reg >= I2C_SPRITE_REG_BASE && reg < I2C_SPRITE_REG_BASE + MAX_SPRITES) {
+            dest = &cxt->sprite_mem[(reg - I2C_SPRITE_REG_BASE) * I2C_SPRITE_DATA_LEN];
+            rx_dma_reg_len = I2C_SPRITE_DATA_LEN;
+            rx_dma_len = (I2C_SPRITE_REG_BASE + MAX_SPRITES - reg) * I2C_SPRITE_DATA_LEN;
+        } else if (reg >= I2C_SCROLL_GROUP_REG_BASE + 1 && reg < I2C_SCROLL_GROUP_REG_BASE + NUM_SCROLL_GROUPS) {
+            dest = &cxt->scroll_group_mem[(reg - I2C_SCROLL_GROUP_REG_BASE - 1) * I2C_SCROLL_GROUP_DATA_LEN];
+            rx_dma_reg_len = I2C_SCROLL_GROUP_DATA_LEN;
+            rx_dma_len = (I2C_SCROLL_GROUP_REG_BASE + NUM_SCROLL_GROUPS - reg) * I2C_SCROLL_GROUP_DATA_LEN;
+        } else if (reg >= I2C_HIGH_REG_BASE && reg < I2C_HIGH_REG_BASE + I2C_NUM_HIGH_REGS) {
+            // Stop before the scroll group registers, which are in their own memory
+            dest = &cxt->high_regs[reg - I2C_HIGH_REG_BASE];
+            rx_dma_reg_len = 1;
+            rx_dma_len = (reg <= I2C_SCROLL_GROUP_REG_BASE ? I2C_SCROLL_GROUP_REG_BASE + 1 : I2C_HIGH_REG_BASE + I2C_NUM_HIGH_REGS) - reg;
+        } else if (reg == I2C_BULK_SPRITE_REGISTER) {
+            dest = bulk_sprite_data;
+            rx_dma_reg_len = 0;
+            rx_dma_len = I2C_BULK_SPRITE_MAX_LEN;
+        } else {
+            return;
+        }
+
+        i2c_hw_t *hw = i2c_get_hw(i2c);
+        dma_channel_configure(rx_dma_channel, &rx_dma_config, dest, &hw->data_cmd, rx_dma_len, true);
+        hw->dma_cr = I2C_IC_DMA_CR_RDMAE_BITS;
+        hw_clear_bits(&hw->intr_mask, I2C_IC_INTR_MASK_M_RX_FULL_BITS);
+    }
+
+    // Called at the end of a write that was using DMA, so cur_register and access_idx are where the DMA got to
+    void finish_rx_dma(i2c_inst_t *i2c, I2CContext* cxt) {
+        i2c_hw_t *hw = i2c_get_hw(i2c);
+
+        // Let the DMA take any bytes still in the FIFO, what it can't take is left for the byte handling
+        while (dma_channel_is_busy(rx_dma_channel) && (hw->status & I2C_IC_STATUS_RFNE_BITS))
+            tight_loop_contents();
+        dma_channel_abort(rx_dma_channel);
+        hw->dma_cr = 0;
+        hw_set_bits(&hw->intr_mask, I2C_IC_INTR_MASK_M_RX_FULL_BITS);
+
+        const uint32_t len = rx_dma_len - dma_channel_hw_addr(rx_dma_channel)->transfer_count;
+        rx_dma_len = 0;
+        if (len > 0) {
+            if (rx_dma_reg_len == 0) {
+                // access_idx counts the bytes of the bulk sprite write
+                cxt->access_idx = len;
+            } else {
+                cxt->cur_register += len / rx_dma_reg_len;
+                cxt->access_idx = len % rx_dma_reg_len;
+            }
+            cxt->data_written = true;
+        }
+    }
+
+    // Called at the end of a write to the bulk sprite register, access_idx is the number of bytes written
+    void apply_bulk_sprite_write(I2CContext* cxt) {
+        if (cxt->access_idx < I2C_BULK_SPRITE_HEADER_LEN) return;
+
+        const uint first_sprite = bulk_sprite_data[0];
+        uint32_t mask = bulk_sprite_data[1] | (bulk_sprite_data[2] << 8) | (bulk_sprite_data[3] << 16) | (bulk_sprite_data[4] << 24);
+        const uint8_t* pos = &bulk_sprite_data[I2C_BULK_SPRITE_HEADER_LEN];
+        const uint8_t* end = &bulk_sprite_data[cxt->access_idx];
+        for (; mask && pos + 4 <= end; mask &= mask - 1, pos += 4) {
+            const uint sprite = first_sprite + __builtin_ctz(mask);
+            if (sprite >= I2C_SPRITE_REG_BASE + MAX_SPRITES) break;
+
+            // Only the position is changed
+            memcpy(&cxt->sprite_mem[sprite * I2C_SPRITE_DATA_LEN + I2C_SPRITE_POS_OFFSET], pos, I2C_SPRITE_POS_DATA_LEN);
+            if (i2c_sprite_moved_callback) i2c_sprite_moved_callback(sprite, sprite, cxt->sprite_mem);
+            else if (i2c_sprite_written_callback) i2c_sprite_written_callback(sprite, sprite, cxt->sprite_mem);
+        }
+    }
+
     // Our handler is called from the I2C ISR, so it must complete quickly. Blocking calls /
     // printing to stdio may interfere with interrupt handling.
     void i2c_slave_handler(i2c_inst_t *i2c, i2c_slave_event_t event) {
@@ -66,6 +201,7 @@ namespace {
                 cxt->access_idx = 0;
                 cxt->got_register = true;
                 cxt->data_written = false;
+                start_rx_dma(i2c, cxt);
             } else if (cxt->cur_register >= I2C_SPRITE_REG_BASE && cxt->cur_register < I2C_SPRITE_REG_BASE + MAX_SPRITES) {
                 // save into memory
                 cxt->sprite_mem[cxt->cur_register * I2C_SPRITE_DATA_LEN + cxt->access_idx] = i2c_read_byte(i2c);
@@ -74,6 +210,15 @@ namespace {
                     ++cxt->cur_register;
                 }
                 cxt->data_written = true;
+            } else if (cxt->cur_register >= I2C_SPRITE_POS_REG_BASE && cxt->cur_register < I2C_SPRITE_POS_REG_BASE + MAX_SPRITES &&
+                       cxt->first_register >= I2C_SPRITE_POS_REG_BASE) {
+                // A sprite table write that runs past the last sprite is discarded, not carried into the window
+                cxt->sprite_mem[(cxt->cur_register - I2C_SPRITE_POS_REG_BASE) * I2C_SPRITE_DATA_LEN + I2C_SPRITE_POS_OFFSET + cxt->access_idx] = i2c_read_byte(i2c);
+                if (++cxt->access_idx == I2C_SPRITE_POS_DATA_LEN) {
+                    cxt->access_idx = 0;
+                    ++cxt->cur_register;
+                }
+                cxt->data_written = true;
             } else if (cxt->cur_register >= I2C_SCROLL_GROUP_REG_BASE + 1 && cxt->cur_register < I2C_SCROLL_GROUP_REG_BASE + NUM_SCROLL_GROUPS) {
                 // save into memory
                 cxt->scroll_group_mem[(cxt->cur_register - I2C_SCROLL_GROUP_REG_BASE - 1) * I2C_SCROLL_GROUP_DATA_LEN + cxt->access_idx] = i2c_read_byte(i2c);
@@ -82,6 +227,17 @@ namespace {
                     ++cxt->cur_register;
                 }
                 cxt->data_written = true;
+            } else if (cxt->cur_register == I2C_BLIT_COMMAND_REGISTER) {
+                // Several commands may be written in one transfer
+                blit_command[cxt->access_idx] = i2c_read_byte(i2c);
+                if (++cxt->access_idx == I2C_BLIT_COMMAND_LEN) {
+                    cxt->access_idx = 0;
+                    if (i2c_blit_command_callback) i2c_blit_command_callback(blit_command);
+                }
+            } else if (cxt->cur_register == I2C_BULK_SPRITE_REGISTER) {
+                const uint8_t data = i2c_read_byte(i2c);
+                if (cxt->access_idx < I2C_BULK_SPRITE_MAX_LEN) bulk_sprite_data[cxt->access_idx++] = data;
+                cxt->data_written = true;
             } else if (cxt->cur_register >= I2C_HIGH_REG_BASE && cxt->cur_register < I2C_HIGH_REG_BASE + I2C_NUM_HIGH_REGS) {
                 cxt->high_regs[cxt->cur_register - I2C_HIGH_REG_BASE] = i2c_read_byte(i2c);
                 ++cxt->cur_register;
@@ -100,6 +256,12 @@ namespace {
                     cxt->access_idx = 0;
                     ++cxt->cur_register;
                 }
+            } else if (cxt->cur_register >= I2C_SPRITE_POS_REG_BASE && cxt->cur_register < I2C_SPRITE_POS_REG_BASE + MAX_SPRITES) {
+                i2c_write_byte(i2c, cxt->sprite_mem[(cxt->cur_register - I2C_SPRITE_POS_REG_BASE) * I2C_SPRITE_DATA_LEN + I2C_SPRITE_POS_OFFSET + cxt->access_idx]);
+                if (++cxt->access_idx == I2C_SPRITE_POS_DATA_LEN) {
+                    cxt->access_idx = 0;
+                    ++cxt->cur_register;
+                }
             } else if (cxt->cur_register >= I2C_SCROLL_GROUP_REG_BASE + 1 && cxt->cur_register < I2C_SCROLL_GROUP_REG_BASE + NUM_SCROLL_GROUPS) {
                 i2c_write_byte(i2c, cxt->scroll_group_mem[(cxt->cur_register - I2C_SCROLL_GROUP_REG_BASE - 1) * I2C_SCROLL_GROUP_DATA_LEN + cxt->access_idx]);
                 if (++cxt->access_idx == I2C_SCROLL_GROUP_DATA_LEN) {
@@ -109,6 +271,14 @@ namespace {
             } else if (cxt->cur_register == I2C_EDID_REGISTER) {
                 i2c_write_byte(i2c, get_edid_data()[cxt->access_idx]);
                 if (++cxt->access_idx == 128) cxt->access_idx = 0;
+            } else if (cxt->cur_register == I2C_PAGED_WINDOW_REGISTER) {
+                const uint32_t offset = cxt->high_regs[I2C_PAGE_SELECT_REG - I2C_HIGH_REG_BASE] * I2C_PAGE_LEN + cxt->access_idx;
+                i2c_write_byte(i2c, (offset < paged_window_len) ? paged_window_data[offset] : 0);
+                if (++cxt->access_idx == I2C_PAGE_LEN) cxt->access_idx = 0;
+            } else if (cxt->cur_register == I2C_SNAPSHOT_REGISTER) {
+                if (snapshot_reading < 0) snapshot_reading = snapshot_current;
+                i2c_write_byte(i2c, (cxt->access_idx < snapshot_len) ? snapshot_data[snapshot_reading][cxt->access_idx] : 0);
+                if (++cxt->access_idx >= snapshot_len) cxt->access_idx = 0;
             } else if (cxt->cur_register == I2C_GPIO_INPUT_REG) {
                 i2c_write_byte(i2c, gpio_get_all() >> 23);
                 ++cxt->cur_register;
@@ -123,6 +293,12 @@ namespace {
             }
             break;
         case I2C_SLAVE_FINISH: // master has signalled Stop / Restart
+            if (rx_dma_len) {
+                finish_rx_dma(i2c, cxt);
+                while (i2c_get_read_available(i2c)) {
+                    i2c_slave_handler(i2c, I2C_SLAVE_RECEIVE);
+                }
+            }
             if (cxt->data_written) {
                 //printf("I2C: W%02hhx-%02hhx\n", cxt->first_register, cxt->cur_register-1);
                 if (cxt->first_register >= I2C_SPRITE_REG_BASE && cxt->first_register < I2C_SPRITE_REG_BASE + MAX_SPRITES) {
@@ -130,16 +306,31 @@ namespace {
                         if (cxt->access_idx == 0) cxt->cur_register--;
                         i2c_sprite_written_callback(cxt->first_register, std::min(cxt->cur_register, uint16_t(I2C_SPRITE_REG_BASE + MAX_SPRITES - 1)), cxt->sprite_mem);
                     }
+                } else if (cxt->first_register >= I2C_SPRITE_POS_REG_BASE && cxt->first_register < I2C_SPRITE_POS_REG_BASE + MAX_SPRITES) {
+                    if (cxt->access_idx == 0) cxt->cur_register--;
+                    const uint8_t end_sprite = std::min(cxt->cur_register, uint16_t(I2C_SPRITE_POS_REG_BASE + MAX_SPRITES - 1)) - I2C_SPRITE_POS_REG_BASE;
+                    if (i2c_sprite_moved_callback) {
+                        i2c_sprite_moved_callback(cxt->first_register - I2C_SPRITE_POS_REG_BASE, end_sprite, cxt->sprite_mem);
+                    } else if (i2c_sprite_written_callback) {
+                        i2c_sprite_written_callback(cxt->first_register - I2C_SPRITE_POS_REG_BASE, end_sprite, cxt->sprite_mem);
+                    }
                 } else if (cxt->first_register >= I2C_HIGH_REG_BASE && cxt->first_register < I2C_HIGH_REG_BASE + I2C_NUM_HIGH_REGS) {
                     if (i2c_reg_written_callback) {
                         i2c_reg_written_callback(cxt->first_register, std::min(cxt->cur_register-1, int(I2C_HIGH_REG_BASE + I2C_NUM_HIGH_REGS - 1)), cxt->high_regs, cxt->scroll_group_mem);
                     }
+                } else if (cxt->first_register == I2C_BULK_SPRITE_REGISTER) {
+                    apply_bulk_sprite_write(cxt);
                 }
             }
             else if (cxt->cur_register > cxt->first_register) {
                 //printf("I2C: R%02hhx-%02hhx\n", cxt->first_register, cxt->cur_register-1);
             }
             cxt->got_register = false;
+            if (snapshot_reading >= 0) {
+                // A read continuing from the current address starts a new snapshot from the beginning
+                snapshot_reading = -1;
+                cxt->access_idx = 0;
+            }
             break;
         default:
             break;
@@ -148,7 +339,7 @@ namespace {
 }
 
 namespace i2c_slave_if {
-    uint8_t* init(void (*sprite_callback)(uint8_t, uint8_t, uint8_t*), void (*reg_callback)(uint8_t, uint8_t, uint8_t*, uint8_t*)) {
+    uint8_t* init(void (*sprite_callback)(uint8_t, uint8_t, uint8_t*), void (*reg_callback)(uint8_t, uint8_t, uint8_t*, uint8_t*), bool rx_dma, bool fast_mode_plus) {
         i2c_reg_written_callback = reg_callback;
         i2c_sprite_written_callback = sprite_callback;
 
@@ -164,7 +355,21 @@ namespace i2c_slave_if {
         gpio_set_function(I2C_SLAVE_SCL_PIN, GPIO_FUNC_I2C);
         gpio_pull_up(I2C_SLAVE_SCL_PIN);
 
-        i2c_init(I2C_INSTANCE, I2C_BAUDRATE);
+        // Fast edges and the strongest drive for Fast-mode Plus, otherwise the pad defaults
+        gpio_set_slew_rate(I2C_SLAVE_SDA_PIN, fast_mode_plus ? GPIO_SLEW_RATE_FAST : GPIO_SLEW_RATE_SLOW);
+        gpio_set_drive_strength(I2C_SLAVE_SDA_PIN, fast_mode_plus ? GPIO_DRIVE_STRENGTH_12MA : GPIO_DRIVE_STRENGTH_4MA);
+
+        rx_dma_channel = rx_dma ? dma_claim_unused_channel(false) : -1;
+        if (rx_dma_channel >= 0) {
+            rx_dma_config = dma_channel_get_default_config(rx_dma_channel);
+            channel_config_set_transfer_data_size(&rx_dma_config, DMA_SIZE_8);
+            channel_config_set_read_increment(&rx_dma_config, false);
+            channel_config_set_write_increment(&rx_dma_config, true);
+            channel_config_set_dreq(&rx_dma_config, i2c_get_dreq(I2C_INSTANCE, false));
+        }
+        rx_dma_len = 0;
+
+        i2c_init(I2C_INSTANCE, fast_mode_plus ? I2C_FAST_MODE_PLUS_BAUDRATE : I2C_BAUDRATE);
         i2c_slave_init(I2C_INSTANCE, I2C_SLAVE_ADDRESS, &i2c_slave_handler);
 
         return context.high_regs;
@@ -173,6 +378,37 @@ namespace i2c_slave_if {
     void deinit() {
         i2c_slave_deinit(I2C_INSTANCE);
         i2c_deinit(I2C_INSTANCE);
+
+        if (rx_dma_channel >= 0) {
+            dma_channel_abort(rx_dma_channel);
+            dma_channel_unclaim(rx_dma_channel);
+            rx_dma_channel = -1;
+        }
+    }
+
+    void set_paged_window(const uint8_t* data, uint32_t len) {
+        paged_window_data = data;
+        paged_window_len = len;
+    }
+
+    void publish_snapshot(const uint8_t* data, uint32_t len) {
+        const uint8_t next = snapshot_current ^ 1;
+
+        // If the last but one snapshot is still being read this one is dropped
+        if (snapshot_reading == next) return;
+
+        snapshot_len = std::min(len, I2C_SNAPSHOT_MAX_LEN);
+        memcpy(snapshot_data[next], data, snapshot_len);
+        __compiler_memory_barrier();
+        snapshot_current = next;
+    }
+
+    void set_blit_command_callback(void (*callback)(const uint8_t*)) {
+        i2c_blit_command_callback = callback;
+    }
+
+    void set_sprite_moved_callback(void (*callback)(uint8_t, uint8_t, uint8_t*)) {
+        i2c_sprite_moved_callback = callback;
     }
 
     uint8_t get_reg(uint8_t reg) {
@@ -182,4 +418,16 @@ namespace i2c_slave_if {
     uint8_t* get_high_reg_table() {
         return context.high_regs;
     }
+
+    bool write_in_progress() {
+        return context.got_register;
+    }
+
+    uint8_t* get_sprite_table() {
+        return context.sprite_mem;
+    }
+
+    uint8_t* get_scroll_group_table() {
+        return context.scroll_group_mem;
+    }
 }
@@ -5,7 +5,7 @@
 // I2C slave interface
 namespace i2c_slave_if {
     // Initialize the I2C slave interface, optionally providing callbacks that are made
-    // after each I2C write is complete.
+    // from the I2C interrupt after each I2C write is complete.
     // The sprite callback arguments are:
     //  - First sprite written
     //  - Last sprite written (same as first if only one sprite written)
@@ -15,14 +15,49 @@ namespace i2c_slave_if {
     //  - Last register written (same as first if only one byte written)
     //  - Pointer start of high register memory (for all registers, the pointer points at register 0xC0)
     // The init call returns the pointer to high register memory, so that it can be properly initialized.
-    uint8_t* init(void (*sprite_callback)(uint8_t, uint8_t, uint8_t*), void (*reg_callback)(uint8_t, uint8_t, uint8_t*, uint8_t*));
+    // If rx_dma is set a DMA channel is claimed, if one is free, to move bulk register writes from the RX FIFO.
+    // Only set it once the display has claimed the channels it needs.
+    // The interface runs at 400kHz, or at 1MHz Fast-mode Plus if fast_mode_plus is set.
+    //
+    // Writing register 0xA4 moves several sprites in one transfer, the sprite moved callback is then made for each:
+    //  Byte 0: First sprite
+    //  Bytes 1-4: Mask of the sprites to move, bit n is sprite first + n, little endian
+    //  Then for each bit set in the mask, lowest first: x and y, 16-bit little endian
+    // The rest of each sprite's data is unchanged.
+    uint8_t* init(void (*sprite_callback)(uint8_t, uint8_t, uint8_t*), void (*reg_callback)(uint8_t, uint8_t, uint8_t*, uint8_t*), bool rx_dma = false, bool fast_mode_plus = false);
 
     // Deinitialize before adjusting clocks, then init again.
     void deinit();
 
+    // Set the data readable through the paged window.  Reading register 0xA0 streams
+    // the 128 byte page of the data selected by register 0xCE, bytes past the end read as 0.
+    void set_paged_window(const uint8_t* data, uint32_t len);
+
+    // Publish a snapshot of up to 128 bytes, readable by streaming register 0xA8.  Each read returns
+    // the whole of one snapshot, the snapshot being read is not changed until the read finishes.
+    // Must be called from the core that handles the I2C interrupt.
+    void publish_snapshot(const uint8_t* data, uint32_t len);
+
+    // Set the callback made from the I2C interrupt each time a 20 byte command is written to register 0xA2
+    void set_blit_command_callback(void (*callback)(const uint8_t*));
+
+    // Registers from 0x50 are a window onto just the x and y of each sprite, 4 bytes per sprite, 16-bit little endian.
+    // Set the callback made from the I2C interrupt after sprites are moved through this window or register 0xA4,
+    // it has the same arguments as the sprite callback.  If it isn't set the sprite callback is made instead.
+    void set_sprite_moved_callback(void (*callback)(uint8_t, uint8_t, uint8_t*));
+
+    // Whether a register has been selected and the transfer hasn't yet finished
+    bool write_in_progress();
+
     // Get the current value of a high register
     uint8_t get_reg(uint8_t reg);
 
     // Get the high register memory, it is 64 bytes long and is 32-bit aligned
     uint8_t* get_high_reg_table();
+
+    // Get the sprite memory, 7 bytes for each sprite
+    uint8_t* get_sprite_table();
+
+    // Get the scroll group memory, 13 bytes for each of the scroll groups from 1, written through 0xE1-0xE7
+    uint8_t* get_scroll_group_table();
 }
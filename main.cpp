@@ -8,6 +8,7 @@
 #include "hardware/gpio.h"
 #include "hardware/irq.h"
 #include "hardware/pwm.h"
+#include "hardware/sync.h"
 #include "hardware/structs/usb.h"
 #include "hardware/watchdog.h"
 #include "pico/bootrom.h"
@@ -111,12 +112,39 @@ static void restart_adc(uint8_t* regs) {
 
 void setup_i2c_reg_data(uint8_t* regs);
 
-void handle_i2c_reg_write(uint8_t reg, uint8_t end_reg, uint8_t* regs, uint8_t* scroll_group_mem) {
+// The I2C interrupt only records which registers and sprites have been written.  The writes are
+// applied by apply_i2c_writes from the main loop, at the start of VSYNC while the display is running,
+// so reconfiguring the peripherals and display can't make the line being prepared late.
+static volatile uint64_t pending_reg_writes = 0;  // Bit n set if register 0xC0 + n has been written
+static volatile uint32_t pending_sprite_writes[(MAX_SPRITES + 31) / 32] = {};
+static volatile uint32_t pending_sprite_moves[(MAX_SPRITES + 31) / 32] = {};  // Only the position written
+
+void handle_i2c_reg_write(uint8_t reg, uint8_t end_reg, uint8_t*, uint8_t*) {
+    pending_reg_writes = pending_reg_writes | ((~0ull << (reg - 0xC0)) & (~0ull >> (0xFF - end_reg)));
+}
+
+void handle_i2c_sprite_write(uint8_t sprite, uint8_t end_sprite, uint8_t*) {
+    for (int i = sprite; i <= end_sprite; ++i) {
+        pending_sprite_writes[i >> 5] = pending_sprite_writes[i >> 5] | (1u << (i & 31));
+    }
+}
+
+void handle_i2c_sprite_move(uint8_t sprite, uint8_t end_sprite, uint8_t*) {
+    for (int i = sprite; i <= end_sprite; ++i) {
+        pending_sprite_moves[i >> 5] = pending_sprite_moves[i >> 5] | (1u << (i & 31));
+    }
+}
+
+// Header address, invalidate frame table, palette index and frame counter: the registers that
+// must be applied before the next frame's headers and frame table are read.
+static constexpr uint64_t FRAME_HEADER_REG_WRITES = (0xFull << (0xF0 - 0xC0)) | (0x3ull << (0xF8 - 0xC0));
+
+static void apply_i2c_reg_writes(uint64_t written, uint8_t* regs, uint8_t* scroll_group_mem) {
     // Subtract 0xC0 from regs so that register numbers match addresses
     regs -= 0xC0;
 
-    #define REG_WRITTEN(R) (reg <= R && end_reg >= R)
-    #define REG_WRITTEN2(R_START, R_END) (reg <= R_END && end_reg >= R_START)
+    #define REG_WRITTEN(R) (((written >> (R - 0xC0)) & 1) != 0)
+    #define REG_WRITTEN2(R_START, R_END) (((written >> (R_START - 0xC0)) & ((2ull << (R_END - R_START)) - 1)) != 0)
 
     if (REG_WRITTEN(0xC1)) {
         display.enable_heartbeat(regs[0xC1] == 2);
@@ -186,12 +214,23 @@ void handle_i2c_reg_write(uint8_t reg, uint8_t end_reg, uint8_t* regs, uint8_t*
         hw_write_masked(&usb_hw->phy_direct, usb_pulls, 0x66);
     }
 
+    if (REG_WRITTEN(0xCD)) {
+        display.set_overload_policy(regs[0xCD]);
+    }
+
+    if (REG_WRITTEN(0xCF)) {
+        display.set_phase_profiling(regs[0xCF] & 1);
+    }
+
     if (REG_WRITTEN(0xD3)) {
         display.clear_peak_scanline_time();
     }
     if (REG_WRITTEN(0xD4)) {
         display.clear_late_scanlines();
     }
+    if (REG_WRITTEN(0xDF)) {
+        display.clear_blits_rejected();
+    }
 
     for (int i = 1; i < NUM_SCROLL_GROUPS; ++i) {
         if (REG_WRITTEN(0xE0 + i)) {
@@ -215,6 +254,27 @@ void handle_i2c_reg_write(uint8_t reg, uint8_t end_reg, uint8_t* regs, uint8_t*
         }
     }
 
+    // Bit 0: Frame headers are followed by a checksum
+    // Bit 1: Keep showing the last good frame if the headers fail their check, instead of stopping
+    if (REG_WRITTEN(0xE8)) {
+        display.set_header_check(regs[0xE8] & 1, regs[0xE8] & 2);
+    }
+
+    if (REG_WRITTEN2(0xF0, 0xF2)) {
+        uint32_t header_addr = (regs[0xF2] << 16) |
+                               (regs[0xF1] << 8) |
+                               (regs[0xF0]);
+        display.set_header_address(header_addr & 0x7FFFFF, (regs[0xF2] & 0x80) != 0);
+    }
+
+    if (REG_WRITTEN(0xF3)) {
+        display.invalidate_frame_table();
+    }
+
+    if (REG_WRITTEN2(0xF4, 0xF6)) {
+        display.set_colour_cycle(regs[0xF4], regs[0xF5], (int8_t)regs[0xF6]);
+    }
+
     if (REG_WRITTEN(0xF8)) {
         display.set_palette_idx(regs[0xF8]);
     }
@@ -245,14 +305,74 @@ void handle_i2c_reg_write(uint8_t reg, uint8_t end_reg, uint8_t* regs, uint8_t*
     #undef REG_WRITTEN2
 }
 
-void handle_i2c_sprite_write(uint8_t sprite, uint8_t end_sprite, uint8_t* sprite_data) {
-    for (int i = sprite; i <= end_sprite; ++i) {
-        uint8_t* sprite_ptr = sprite_data + 7 * i;
+void handle_i2c_blit_command(const uint8_t* cmd) {
+    display.queue_blit(cmd);
+}
 
-        int16_t sprite_idx = (int8_t(sprite_ptr[2]) << 8) | sprite_ptr[1];
-        int16_t x = (sprite_ptr[4] << 8) | sprite_ptr[3];
-        int16_t y = (sprite_ptr[6] << 8) | sprite_ptr[5];
-        display.set_sprite(i, sprite_idx, (pico_stick::BlendMode)(sprite_ptr[0] & 0x7), x, y, (sprite_ptr[0] >> 3) + 1);
+static void apply_i2c_sprite_write(int i, const uint8_t* sprite_data) {
+    const uint8_t* sprite_ptr = sprite_data + 7 * i;
+
+    int16_t sprite_idx = (int8_t(sprite_ptr[2]) << 8) | sprite_ptr[1];
+    int16_t x = (sprite_ptr[4] << 8) | sprite_ptr[3];
+    int16_t y = (sprite_ptr[6] << 8) | sprite_ptr[5];
+    display.set_sprite(i, sprite_idx, (pico_stick::BlendMode)(sprite_ptr[0] & 0x7), x, y, (sprite_ptr[0] >> 3) + 1);
+}
+
+static void apply_i2c_sprite_move(int i, const uint8_t* sprite_data) {
+    const uint8_t* sprite_ptr = sprite_data + 7 * i;
+
+    int16_t x = (sprite_ptr[4] << 8) | sprite_ptr[3];
+    int16_t y = (sprite_ptr[6] << 8) | sprite_ptr[5];
+    display.move_sprite(i, x, y);
+}
+
+void apply_i2c_writes() {
+    // A write still in progress is applied once it is complete
+    if (i2c_slave_if::write_in_progress()) return;
+
+    uint32_t sprite_writes[(MAX_SPRITES + 31) / 32];
+    uint32_t sprite_moves[(MAX_SPRITES + 31) / 32];
+    uint32_t save = save_and_disable_interrupts();
+    const uint64_t reg_writes = pending_reg_writes;
+    pending_reg_writes = 0;
+    for (int i = 0; i < (MAX_SPRITES + 31) / 32; ++i) {
+        sprite_writes[i] = pending_sprite_writes[i];
+        pending_sprite_writes[i] = 0;
+        sprite_moves[i] = pending_sprite_moves[i] & ~sprite_writes[i];
+        pending_sprite_moves[i] = 0;
+    }
+    restore_interrupts(save);
+
+    for (int i = 0; i < (MAX_SPRITES + 31) / 32; ++i) {
+        while (sprite_writes[i]) {
+            const int bit = __builtin_ctz(sprite_writes[i]);
+            sprite_writes[i] &= sprite_writes[i] - 1;
+            apply_i2c_sprite_write(i * 32 + bit, i2c_slave_if::get_sprite_table());
+        }
+        while (sprite_moves[i]) {
+            const int bit = __builtin_ctz(sprite_moves[i]);
+            sprite_moves[i] &= sprite_moves[i] - 1;
+            apply_i2c_sprite_move(i * 32 + bit, i2c_slave_if::get_sprite_table());
+        }
+    }
+
+    if (reg_writes) {
+        apply_i2c_reg_writes(reg_writes, i2c_slave_if::get_high_reg_table(), i2c_slave_if::get_scroll_group_table());
+    }
+}
+
+// Called during the last lines of a frame, before the next frame's headers are read early.
+// Only the writes that affect that read are applied, everything else waits for VSYNC.
+void apply_i2c_frame_header_writes() {
+    if (i2c_slave_if::write_in_progress()) return;
+
+    uint32_t save = save_and_disable_interrupts();
+    const uint64_t reg_writes = pending_reg_writes & FRAME_HEADER_REG_WRITES;
+    pending_reg_writes = pending_reg_writes & ~FRAME_HEADER_REG_WRITES;
+    restore_interrupts(save);
+
+    if (reg_writes) {
+        apply_i2c_reg_writes(reg_writes, i2c_slave_if::get_high_reg_table(), i2c_slave_if::get_scroll_group_table());
     }
 }
 
@@ -272,10 +392,77 @@ void set_i2c_reg_data_for_frame(uint8_t* regs, const DisplayDriver::Diags& diags
     regs[0xD6] = (diags.total_late_scanlines) >> 16;
     regs[0xD7] = (diags.total_late_scanlines) >> 24;
     regs[0xD8] = std::max(diags.scanline_max_sprites[0], diags.scanline_max_sprites[1]);
+
+    // Blits finished, and whether any have been rejected since 0xDF was last written
+    regs[0xDF] = (diags.blits_completed & 0x7F) | (diags.blits_rejected ? 0x80 : 0);
+
+    // Frames whose headers failed their check
+    regs[0xE9] = diags.header_failures;
+}
+
+// Diags snapshot read through register 0xA8, all fields little endian.
+// The registers from 0xD0 are updated in place, so a read of several of them may mix two frames,
+// while a read of the snapshot always comes from a single frame.
+struct DiagsSnapshot {
+    static constexpr uint8_t VERSION = 1;
+
+    uint8_t version = VERSION;   // Incremented if the meaning of existing fields changes
+    uint8_t len = sizeof(DiagsSnapshot);  // New fields are only added at the end
+    uint16_t reserved = 0;
+    uint32_t frame;              // Frames output since boot
+    uint32_t vsync_time;         // us
+    uint32_t available_vsync_time;
+    uint32_t scanline_total_prep_time[2];  // us, for each core
+    uint32_t scanline_max_prep_time[2];
+    uint32_t available_total_scanline_time;
+    uint32_t available_time_per_scanline;
+    uint32_t peak_scanline_time;
+    uint32_t total_late_scanlines;
+    uint32_t scanline_max_sprites[2];
+    uint32_t degraded_lines[2];
+    uint32_t degraded_patches_skipped[2];
+    uint32_t degraded_blends[2];
+    uint32_t line_read_stalls;
+    uint32_t sprites_deferred;
+    uint32_t sprites_loaded_late;
+    uint32_t blits_completed;
+    uint32_t blits_rejected;
+    uint32_t header_failures;
+};
+static_assert(sizeof(DiagsSnapshot) <= 128, "Diags snapshot too large for I2C");
+
+static uint32_t diags_snapshot_frame = 0;
+
+static void publish_diags_snapshot(const DisplayDriver::Diags& diags) {
+    DiagsSnapshot snapshot;
+    snapshot.frame = ++diags_snapshot_frame;
+    snapshot.vsync_time = diags.vsync_time;
+    snapshot.available_vsync_time = diags.available_vsync_time;
+    snapshot.available_total_scanline_time = diags.available_total_scanline_time;
+    snapshot.available_time_per_scanline = diags.available_time_per_scanline;
+    snapshot.peak_scanline_time = diags.peak_scanline_time;
+    snapshot.total_late_scanlines = diags.total_late_scanlines;
+    for (int i = 0; i < 2; ++i) {
+        snapshot.scanline_total_prep_time[i] = diags.scanline_total_prep_time[i];
+        snapshot.scanline_max_prep_time[i] = diags.scanline_max_prep_time[i];
+        snapshot.scanline_max_sprites[i] = diags.scanline_max_sprites[i];
+        snapshot.degraded_lines[i] = diags.degraded_lines[i];
+        snapshot.degraded_patches_skipped[i] = diags.degraded_patches_skipped[i];
+        snapshot.degraded_blends[i] = diags.degraded_blends[i];
+    }
+    snapshot.line_read_stalls = diags.line_read_stalls;
+    snapshot.sprites_deferred = diags.sprites_deferred;
+    snapshot.sprites_loaded_late = diags.sprites_loaded_late;
+    snapshot.blits_completed = diags.blits_completed;
+    snapshot.blits_rejected = diags.blits_rejected;
+    snapshot.header_failures = diags.header_failures;
+
+    i2c_slave_if::publish_snapshot((const uint8_t*)&snapshot, sizeof(snapshot));
 }
 
 void handle_display_diags_callback(const DisplayDriver::Diags& diags) {
     set_i2c_reg_data_for_frame(i2c_slave_if::get_high_reg_table(), diags);
+    publish_diags_snapshot(diags);
 }
 
 void setup_i2c_reg_data(uint8_t* regs) {
@@ -342,6 +529,9 @@ int main() {
 
     uint8_t* regs = i2c_slave_if::init(handle_i2c_sprite_write, handle_i2c_reg_write);
     setup_i2c_reg_data(regs);
+    i2c_slave_if::set_paged_window((const uint8_t*)&display.get_line_trace(), sizeof(DisplayDriver::LineTrace));
+    i2c_slave_if::set_blit_command_callback(handle_i2c_blit_command);
+    i2c_slave_if::set_sprite_moved_callback(handle_i2c_sprite_move);
     regs -= 0xC0;
     restart_adc(regs);
     printf("DV Display Driver I2C Initialised\n");
@@ -349,10 +539,17 @@ int main() {
     read_edid();
 
     while(true) {
-        // Wait for I2C to indicate we should start
-        while (regs[0xFD] == 0) __wfe();
+        // Wait for I2C to indicate we should start, applying register writes as they complete
+        // so a mode set in the same write as the start is applied first
+        while (regs[0xFD] == 0 || i2c_slave_if::write_in_progress()) {
+            __wfe();
+            apply_i2c_writes();
+        }
+        apply_i2c_writes();
         display.init();
         display.diags_callback = handle_display_diags_callback;
+        display.vsync_callback = apply_i2c_writes;
+        display.frame_header_callback = apply_i2c_frame_header_writes;
         printf("DV Display Driver Initialised\n");
 
         // Deinit I2C before adjusting clock
@@ -366,12 +563,25 @@ int main() {
         set_sys_clock_khz(display.get_clock_khz(), true);
 
         stdio_init_all();
+        // Find the most reliable PSRAM read timing for this board at this clock, unless bit 0 of 0xDB is set.
+        // Bit 1 of 0xDB allows a timing that clocks the PSRAM above its rating to be picked.
+        const bool calibrate_ram = (regs[0xDB] & 1) == 0;
+        if (!calibrate_ram) display.get_ram().clear_calibration();
         display.get_ram().adjust_clock();
 
-        // Reinit I2C now clock is set.
-        i2c_slave_if::init(handle_i2c_sprite_write, handle_i2c_reg_write);
+        uint8_t ram_timing_pass_mask = 0;
+        int ram_read_timing = -1;
+        if (calibrate_ram) {
+            ram_read_timing = display.get_ram().calibrate(ram_timing_pass_mask, (regs[0xDB] & 2) != 0);
+        }
+
+        // Reinit I2C now clock is set.  The display's DMA channels are claimed, so I2C can use a spare one.
+        // Bit 2 of 0xDB switches the interface to 1MHz Fast-mode Plus from here.
+        i2c_slave_if::init(handle_i2c_sprite_write, handle_i2c_reg_write, true, (regs[0xDB] & 4) != 0);
+        regs[0xD9] = ram_timing_pass_mask;
+        regs[0xDA] = ram_read_timing;
 
-        printf("DV Driver: Clock configured\n");
+        printf("DV Driver: Clock configured, PSRAM read timing %d (pass mask %02x)\n", ram_read_timing, ram_timing_pass_mask);
 
         display.run();
 
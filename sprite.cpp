@@ -34,53 +34,47 @@ void Sprite::copy_sprite(const Sprite& other) {
     data = other.data;
 }
 
-void Sprite::setup_patches(DisplayDriver& disp) {
+static_assert(sizeof(Sprite::BlendPatch) == 8, "Blend patches should pack into 8 bytes");
+static_assert(MAX_SPRITES <= 128, "Sprite index must fit in a blend patch");
+
+void Sprite::setup_patches(DisplayDriver& disp, int sprite_idx, int first_line) {
     assert(idx >= 0);
     if (data == nullptr) return;
 
     for (int i = 0; i < header.height; ++i) {
         int line_idx = y + i*v_scale;
-        if (line_idx < 0 || line_idx >= disp.frame_data.config.v_length) continue;
+        if (line_idx < first_line || line_idx >= disp.frame_data.config.v_length) continue;
         auto& line = lines[i];
         if (line.width == 0) continue;
         
-        int start = x + line.offset;
-        int end = start + line.width;
-        int start_offset = 0;
         int line_len = disp.frame_data.config.h_length;
         if (disp.frame_table[line_idx].h_repeat() == 2) line_len >>= 1;
 
-        if (end <= 0) continue;
-        if (start >= line_len) continue;
-        if (end > line_len) end = line_len;
-        
-        const int pixel_size = get_pixel_data_len(header.sprite_mode());
-        start *= pixel_size;
-        end *= pixel_size;
-        if (start < 0) {
-            start_offset = -start;
-            start = 0;
-        }
-
-        int len = end - start;
-        if (len > 128) { 
-            len = 128;
-        }
+        int start, len, start_offset;
+        if (!clip_line(x, line, get_pixel_data_len(header.sprite_mode()), line_len, start, len, start_offset)) continue;
 
         uint8_t* const sprite_data_ptr = data + line.data_start + start_offset;
 
         for (uint8_t i = 0; i < v_scale && line_idx < disp.frame_data.config.v_length; ++i) {
-            auto* patch = disp.patches[line_idx++];
+            // Deferred sprites are loaded out of order, so insert the patch in sprite order.
+            // If the line is full the patch for the highest sprite is dropped.
+            auto* patches = disp.patches[line_idx++];
             int j = 0;
-            for (; patch->data && j < MAX_PATCHES_PER_LINE; ++j) {
-                ++patch;
-            }
+            for (; j < MAX_PATCHES_PER_LINE && patches[j].data && patches[j].sprite < sprite_idx; ++j) {}
             if (j == MAX_PATCHES_PER_LINE) {
                 continue;
             }
+            int last = j;
+            while (last < MAX_PATCHES_PER_LINE - 1 && patches[last].data) ++last;
+            for (; last > j; --last) {
+                patches[last] = patches[last - 1];
+            }
+
+            auto* patch = &patches[j];
             patch->data = sprite_data_ptr;
             patch->offset = start;
             patch->len = len;
+            patch->sprite = sprite_idx;
             patch->mode = blend_mode;
         }
     }
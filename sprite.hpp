@@ -1,29 +1,42 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 #include "constants.hpp"
 #include "frame_decode.hpp"
 
 class Sprite {
     public:
+        // Settings take effect when latched at VSYNC, so sprites loaded during the frame
+        // are shown as they were at the start of it.
         void set_sprite_table_idx(int16_t table_idx) {
-            idx = table_idx;
+            next.idx = table_idx;
         }
 
         bool is_enabled() const { return idx >= 0; }
 
         int16_t get_sprite_table_idx() const { return idx; }
 
+        int16_t get_sprite_y() const { return y; }
+
         void set_sprite_pos(int16_t new_x, int16_t new_y) {
-            x = new_x; y = new_y;
+            next.x = new_x; next.y = new_y;
         }
 
         void set_blend_mode(pico_stick::BlendMode mode) {
-            blend_mode = mode;
+            next.blend_mode = mode;
         }
 
         void set_sprite_v_scale(uint8_t new_v_scale) {
-            v_scale = new_v_scale;
+            next.v_scale = new_v_scale;
+        }
+
+        void latch_settings() {
+            x = next.x;
+            y = next.y;
+            idx = next.idx;
+            v_scale = next.v_scale;
+            blend_mode = next.blend_mode;
         }
 
         pico_stick::BlendMode get_blend_mode() const {
@@ -37,16 +50,42 @@ class Sprite {
             uint32_t ctrl;    // Control word for DMA chain
         };
 
+        // Patches on a line are kept in sprite order, so later sprites are drawn over earlier ones
         struct BlendPatch {
             uint8_t* data;
-            uint16_t offset; // in bytes
-            uint8_t len;     // in bytes
-            pico_stick::BlendMode mode;
+            uint32_t offset : 12;  // in bytes
+            uint32_t len : 8;      // in bytes
+            uint32_t sprite : 7;
+            pico_stick::BlendMode mode : 5;
         };
 
+        // Clip a sprite line drawn at x to a frame line line_len pixels long.  Returns false if none of it is visible,
+        // otherwise sets the patch offset and length in bytes, and the byte offset into the sprite line data.
+        static bool clip_line(int x, const pico_stick::SpriteLine& line, int pixel_size, int line_len, int& offset, int& len, int& data_offset) {
+            int start = x + line.offset;
+            int end = start + line.width;
+
+            if (end <= 0) return false;
+            if (start >= line_len) return false;
+            if (end > line_len) end = line_len;
+
+            start *= pixel_size;
+            end *= pixel_size;
+            data_offset = 0;
+            if (start < 0) {
+                data_offset = -start;
+                start = 0;
+            }
+
+            offset = start;
+            len = std::min(end - start, 128);
+            return true;
+        }
+
         void update_sprite(FrameDecode& frame_data);
         void copy_sprite(const Sprite& other);
-        void setup_patches(class DisplayDriver& disp);
+        // Lines before first_line are left alone, they may already be being output
+        void setup_patches(class DisplayDriver& disp, int sprite_idx, int first_line = 0);
         static void apply_blend_patch_555_x(const BlendPatch& patch, uint8_t* frame_pixel_data);
         static void apply_blend_patch_555_y(const BlendPatch& patch, uint8_t* frame_pixel_data);
         static void apply_blend_patch_byte_x(const BlendPatch& patch, uint8_t* frame_pixel_data);
@@ -56,12 +95,21 @@ class Sprite {
         static void clear_sprite_data();
 
     private:
+        // Latched settings
         int16_t x;
         int16_t y;
         int16_t idx = -1;
         uint8_t v_scale = 1;
         pico_stick::BlendMode blend_mode = pico_stick::BLEND_NONE;
 
+        struct Settings {
+            int16_t x = 0;
+            int16_t y = 0;
+            int16_t idx = -1;
+            uint8_t v_scale = 1;
+            pico_stick::BlendMode blend_mode = pico_stick::BLEND_NONE;
+        } next;
+
         pico_stick::SpriteHeader header;
         pico_stick::SpriteLine lines[MAX_SPRITE_HEIGHT];
         uint8_t* data = nullptr;
@@ -0,0 +1,359 @@
+// Frame budget estimator
+//
+// Reads a PSRAM image laid out as described in FrameFormat.txt, plus optionally a list of
+// sprite placements, and estimates the PSRAM traffic and scanline preparation cost of each
+// line of a frame.  Lines predicted to take longer than the driver has to prepare them are flagged.
+//
+// The image is decoded with the driver's FrameDecode and the sprite clipping is Sprite::clip_line,
+// so the layout is interpreted exactly as the firmware does.  The line reads are timed by running the
+// driver's PSRAM command lists through the model of the PIO programs in host_aps6404.cpp.
+// The other cycle costs are estimates, calibrate them against the phase profiling diags
+// (register 0xCF) from real hardware.
+//
+// Usage: frame_budget <psram image> [options]
+//   -s <file>          Sprite placements, one per line: table_index x y [blend_mode [v_scale]]
+//   -f <frame>         Frame to analyse, default is the first frame from the frame table header
+//   -a <address>       Header address, default 0
+//   -r <resolution>    pico_stick::Resolution, default is from the header
+//   -t <h_total>,<bit_clk_khz>  Timing for resolutions not in the built in table
+//   -c <sys_clk_khz>   System clock, default is the bit clock, as the driver runs
+//   -v                 List every line, not just those over budget
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include "frame_decode.hpp"
+#include "sprite.hpp"
+#include "host_ram.hpp"
+
+using namespace pico_stick;
+
+namespace {
+    struct Timing {
+        Resolution res;
+        const char* name;
+        uint32_t h_total;      // Pixels per scanline, including blanking
+        uint32_t bit_clk_khz;
+    };
+
+    const Timing timings[] = {
+        { RESOLUTION_640x480, "640x480p60", 800, 252000 },
+        { RESOLUTION_720x480, "720x480p60", 858, 270000 },
+        { RESOLUTION_720x400, "720x400p70", 900, 283200 },
+        { RESOLUTION_720x576, "720x576p50", 864, 270000 },
+    };
+
+    // Estimated RP2040 cycles.  Encode costs are per pixel read from PSRAM.
+    namespace cost {
+        constexpr uint32_t LINE_OVERHEAD = 500;            // Handing the line between the cores and the TMDS queues
+        constexpr uint32_t PATCH_OVERHEAD = 60;
+        constexpr uint32_t ENCODE_DOUBLED_PALETTE256 = 7;
+        constexpr uint32_t ENCODE_DOUBLED_RGB888 = 9;
+        constexpr uint32_t ENCODE_DOUBLED_PALETTE = 6;
+        constexpr uint32_t ENCODE_DOUBLED_ARGB1555 = 8;
+        constexpr uint32_t ENCODE_FULLRES_PALETTE = 10;
+        constexpr uint32_t ENCODE_FULLRES_ARGB1555 = 12;
+        constexpr uint32_t PATCH_BYTE = 2;                 // Per byte, palette and RGB888 lines
+        constexpr uint32_t PATCH_PIXEL_555[] = { 2, 5, 4, 8, 7 };  // Per pixel, by BlendMode
+    }
+
+    struct Placement {
+        int16_t table_idx;
+        int16_t x, y;
+        BlendMode blend_mode;
+        uint8_t v_scale;
+    };
+
+    struct LinePatch {
+        int len;
+        BlendMode mode;
+    };
+
+    struct LineEstimate {
+        uint32_t psram_bytes;
+        std::vector<LinePatch> patches;
+        uint32_t patches_dropped;
+        uint32_t cycles;
+    };
+
+    [[noreturn]] void usage() {
+        fprintf(stderr, "Usage: frame_budget <psram image> [-s sprites] [-f frame] [-a header address] [-r resolution] [-t h_total,bit_clk_khz] [-c sys_clk_khz] [-v]\n");
+        exit(1);
+    }
+
+    std::vector<uint8_t> read_file(const char* filename) {
+        FILE* f = fopen(filename, "rb");
+        if (!f) {
+            fprintf(stderr, "Can't open %s\n", filename);
+            exit(1);
+        }
+
+        std::vector<uint8_t> data;
+        uint8_t buf[4096];
+        size_t len;
+        while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+            data.insert(data.end(), buf, buf + len);
+        }
+        fclose(f);
+        return data;
+    }
+
+    std::vector<Placement> read_placements(const char* filename) {
+        FILE* f = fopen(filename, "r");
+        if (!f) {
+            fprintf(stderr, "Can't open %s\n", filename);
+            exit(1);
+        }
+
+        std::vector<Placement> placements;
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            if (line[0] == '#') continue;
+
+            int idx, x, y, mode = BLEND_NONE, v_scale = 1;
+            if (sscanf(line, "%d %d %d %d %d", &idx, &x, &y, &mode, &v_scale) < 3) continue;
+            placements.push_back({ int16_t(idx), int16_t(x), int16_t(y), BlendMode(mode), uint8_t(v_scale) });
+        }
+        fclose(f);
+
+        if (placements.size() > MAX_SPRITES) {
+            fprintf(stderr, "Only %d sprites are supported, ignoring the rest\n", MAX_SPRITES);
+            placements.resize(MAX_SPRITES);
+        }
+        return placements;
+    }
+
+    // Mirrors the encoder selection in DisplayDriver::prepare_scanline_core0/1
+    uint32_t encode_cycles(const FrameTableEntry& entry, uint32_t h_length) {
+        if (entry.h_repeat() == 2) {
+            const uint32_t pixels = h_length >> 1;
+            switch (entry.line_mode()) {
+                case MODE_PALETTE256: return pixels * cost::ENCODE_DOUBLED_PALETTE256;
+                case MODE_RGB888:     return pixels * cost::ENCODE_DOUBLED_RGB888;
+                case MODE_PALETTE:    return pixels * cost::ENCODE_DOUBLED_PALETTE;
+                default:              return pixels * cost::ENCODE_DOUBLED_ARGB1555;
+            }
+        }
+        else if (entry.line_mode() == MODE_PALETTE) return h_length * cost::ENCODE_FULLRES_PALETTE;
+        else return h_length * cost::ENCODE_FULLRES_ARGB1555;
+    }
+
+    const char* line_mode_name(LineMode mode) {
+        switch (mode) {
+            case MODE_ARGB1555:   return "ARGB1555";
+            case MODE_PALETTE:    return "PAL32";
+            case MODE_RGB888:     return "RGB888";
+            case MODE_PALETTE256: return "PAL256";
+            default:              return "?";
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) usage();
+
+    const char* image_filename = argv[1];
+    const char* sprite_filename = nullptr;
+    int frame = -1;
+    uint32_t header_address = 0;
+    int res = -1;
+    uint32_t h_total = 0, bit_clk_khz = 0, sys_clk_khz = 0;
+    bool verbose = false;
+
+    for (int i = 2; i < argc; ++i) {
+        if (!strcmp(argv[i], "-v")) {
+            verbose = true;
+            continue;
+        }
+        if (i + 1 >= argc) usage();
+
+        const char* arg = argv[++i];
+        switch (argv[i - 1][1]) {
+            case 's': sprite_filename = arg; break;
+            case 'f': frame = strtol(arg, nullptr, 0); break;
+            case 'a': header_address = strtoul(arg, nullptr, 0); break;
+            case 'r': res = strtol(arg, nullptr, 0); break;
+            case 'c': sys_clk_khz = strtoul(arg, nullptr, 0); break;
+            case 't':
+                if (sscanf(arg, "%u,%u", &h_total, &bit_clk_khz) != 2) usage();
+                break;
+            default: usage();
+        }
+    }
+
+    std::vector<uint8_t> image = read_file(image_filename);
+    host_ram::load(image.data(), image.size());
+
+    pimoroni::APS6404 ram;
+    FrameDecode frame_data(ram);
+    frame_data.set_header_address(header_address);
+    if (!frame_data.read_headers()) {
+        fprintf(stderr, "No valid headers at 0x%06x\n", header_address);
+        return 1;
+    }
+
+    const Config& config = frame_data.config;
+    const FrameTableHeader& frame_table_header = frame_data.frame_table_header;
+    if (config.v_length > MAX_FRAME_HEIGHT || config.v_length > frame_table_header.frame_table_length) {
+        fprintf(stderr, "Invalid frame: v_length %d, frame table length %d\n", config.v_length, frame_table_header.frame_table_length);
+        return 1;
+    }
+
+    if (res < 0) res = config.res;
+    const char* res_name = "custom";
+    if (h_total == 0) {
+        for (auto& timing : timings) {
+            if (timing.res == res) {
+                h_total = timing.h_total;
+                bit_clk_khz = timing.bit_clk_khz;
+                res_name = timing.name;
+            }
+        }
+        if (h_total == 0) {
+            fprintf(stderr, "No timing for resolution 0x%02x, specify it with -t\n", res);
+            return 1;
+        }
+    }
+    if (sys_clk_khz == 0) sys_clk_khz = bit_clk_khz;
+
+    // As the driver calculates it, but in system clocks.  Each core prepares every other line,
+    // and each frame line is output v_repeat times.  The next pair of lines is read while the
+    // current pair is output, so a pair read has the same budget as preparing one line.
+    const uint32_t pixel_clk_khz = bit_clk_khz / 10;
+    const uint32_t scanline_cycles = uint32_t((uint64_t(h_total) * sys_clk_khz) / pixel_clk_khz);
+    const uint32_t v_repeat = std::max(1, int(config.v_repeat));
+    const uint32_t line_budget = 2 * v_repeat * scanline_cycles;
+
+    if (frame < 0) frame = frame_table_header.first_frame;
+    std::vector<FrameTableEntry> frame_table(frame_table_header.frame_table_length);
+    frame_data.get_frame_table(frame, frame_table.data());
+
+    // Each pair of lines is read together by one multi_read, as DisplayDriver::read_two_lines does without scrolling
+    host_ram::set_sys_clock_khz(sys_clk_khz);
+    ram.adjust_clock();
+    std::vector<LineEstimate> lines(config.v_length);
+    std::vector<uint32_t> pair_psram_cycles((config.v_length + 1) >> 1);
+    std::vector<uint32_t> line_buf(((MAX_FRAME_WIDTH + 1) * 3) / 2);
+    for (int i = 0; i < config.v_length; i += 2) {
+        uint32_t addresses[2], lengths[2];
+        const int num_lines = std::min(2, config.v_length - i);
+        for (int j = 0; j < num_lines; ++j) {
+            addresses[j] = frame_table[i + j].line_address();
+            lengths[j] = lines[i + j].psram_bytes = frame_data.get_line_data_len(frame_table[i + j]);
+        }
+
+        host_ram::reset_stats();
+        ram.multi_read(addresses, lengths, num_lines, line_buf.data());
+        pair_psram_cycles[i >> 1] = host_ram::get_stats().cycles;
+    }
+
+    // Sprites, loaded as in Sprite::update_sprite and placed as in Sprite::setup_patches
+    uint32_t sprite_bytes = 0;
+    host_ram::reset_stats();
+    if (sprite_filename) {
+        const std::vector<Placement> placements = read_placements(sprite_filename);
+        std::vector<uint32_t> sprite_data(MAX_SPRITE_DATA_BYTES / 4);
+
+        for (const Placement& p : placements) {
+            if (p.table_idx < 0) continue;
+            if (p.table_idx >= frame_table_header.num_sprites) {
+                fprintf(stderr, "Sprite %d is not in the sprite table (%d sprites)\n", p.table_idx, frame_table_header.num_sprites);
+                continue;
+            }
+
+            SpriteHeader header;
+            SpriteLine sprite_lines[FrameDecode::MAX_SPRITE_HEIGHT];
+            frame_data.get_sprite_header(p.table_idx, &header);
+            if (header.height > MAX_SPRITE_HEIGHT) {
+                fprintf(stderr, "Sprite %d is %d lines high, the maximum is %d\n", p.table_idx, header.height, MAX_SPRITE_HEIGHT);
+                continue;
+            }
+            const uint32_t len = frame_data.get_sprite(p.table_idx, header, sprite_lines, sprite_data.data(), MAX_SPRITE_DATA_BYTES - sprite_bytes);
+            if (len == 0) {
+                fprintf(stderr, "Sprite %d doesn't fit in the sprite data buffer\n", p.table_idx);
+                continue;
+            }
+            sprite_bytes += len;
+
+            for (int i = 0; i < header.height; ++i) {
+                int line_idx = p.y + i * p.v_scale;
+                if (line_idx < 0 || line_idx >= config.v_length) continue;
+                if (sprite_lines[i].width == 0) continue;
+
+                int line_len = config.h_length;
+                if (frame_table[line_idx].h_repeat() == 2) line_len >>= 1;
+
+                int offset, len, data_offset;
+                if (!Sprite::clip_line(p.x, sprite_lines[i], get_pixel_data_len(header.sprite_mode()), line_len, offset, len, data_offset)) continue;
+
+                for (int j = 0; j < p.v_scale && line_idx < config.v_length; ++j, ++line_idx) {
+                    LineEstimate& line = lines[line_idx];
+                    if (line.patches.size() == MAX_PATCHES_PER_LINE) ++line.patches_dropped;
+                    else line.patches.push_back({ len, p.blend_mode });
+                }
+            }
+        }
+    }
+    const host_ram::Stats sprite_reads = host_ram::get_stats();
+
+    // Scanline cost
+    for (int i = 0; i < config.v_length; ++i) {
+        LineEstimate& line = lines[i];
+        const FrameTableEntry& entry = frame_table[i];
+        const bool byte_patches = entry.line_mode() == MODE_PALETTE || entry.line_mode() == MODE_RGB888 || entry.line_mode() == MODE_PALETTE256;
+
+        line.cycles = cost::LINE_OVERHEAD + encode_cycles(entry, config.h_length);
+        for (const LinePatch& patch : line.patches) {
+            line.cycles += cost::PATCH_OVERHEAD;
+            if (byte_patches) line.cycles += patch.len * cost::PATCH_BYTE;
+            else line.cycles += (patch.len >> 1) * cost::PATCH_PIXEL_555[std::min(int(patch.mode), int(BLEND_BLEND2))];
+        }
+    }
+
+    printf("%s, %dx%d, v_repeat %d, frame %d of %d\n", res_name, config.h_length, config.v_length, v_repeat, frame, frame_table_header.num_frames);
+    printf("System clock %ukHz, %u cycles to prepare each line or read each line pair\n\n", sys_clk_khz, line_budget);
+    if (verbose) printf(" Line  Mode      Rpt  Bytes  Patches  Cycles  Budget%%\n");
+
+    int lines_over = 0, pairs_over = 0, total_dropped = 0;
+    uint32_t total_psram_bytes = 0, total_psram_cycles = 0;
+    uint32_t worst_cycles = 0;
+    int worst_line = 0;
+    for (int i = 0; i < config.v_length; ++i) {
+        const LineEstimate& line = lines[i];
+        const bool over = line.cycles > line_budget;
+        if (over) ++lines_over;
+        total_dropped += line.patches_dropped;
+        total_psram_bytes += line.psram_bytes;
+        if (line.cycles > worst_cycles) {
+            worst_cycles = line.cycles;
+            worst_line = i;
+        }
+
+        if ((i & 1) == 0) total_psram_cycles += pair_psram_cycles[i >> 1];
+        if ((i & 1) && pair_psram_cycles[i >> 1] > line_budget) {
+            printf("Lines %d-%d: PSRAM read of %u bytes won't keep up\n", i - 1, i, lines[i - 1].psram_bytes + line.psram_bytes);
+            ++pairs_over;
+        }
+
+        if (verbose || over || line.patches_dropped) {
+            printf("%5d  %-8s  %3d  %5u  %4d%s  %6u  %6u%s\n", i, line_mode_name(frame_table[i].line_mode()), frame_table[i].h_repeat(),
+                   line.psram_bytes, int(line.patches.size()), line.patches_dropped ? "+" : " ", line.cycles,
+                   (line.cycles * 100) / line_budget, over ? "  OVER" : "");
+        }
+    }
+
+    printf("\nWorst line %d: %u cycles, %u%% of budget\n", worst_line, worst_cycles, (worst_cycles * 100) / line_budget);
+    printf("%d lines over budget, %d line pairs where the PSRAM reads won't keep up\n", lines_over, pairs_over);
+    if (total_dropped) printf("%d sprite patches dropped, more than %d on a line\n", total_dropped, MAX_PATCHES_PER_LINE);
+    printf("PSRAM: %u bytes of line data, busy for %u%% of the active lines\n", total_psram_bytes,
+           uint32_t((uint64_t(total_psram_cycles) * 100) / (uint64_t(scanline_cycles) * config.v_length * v_repeat)));
+    if (sprite_filename) {
+        printf("Sprites: %u bytes of sprite data in %u reads, about %u cycles at VSYNC\n", sprite_bytes, sprite_reads.reads,
+               sprite_reads.cycles);
+    }
+
+    return (lines_over || pairs_over) ? 2 : 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+// The parts of the pioasm output for aps6404.pio used on the host.  The offsets must match
+// aps6404.pio, the sram, sram_slow and sram_fast programs all have the same layout.
+//
+// In place of the instructions each program has the timing of its read commands, counted from
+// aps6404.pio in system clocks, for the PSRAM model in host_aps6404.cpp.
+
+#include <stdint.h>
+
+struct pio_program {
+    const char* name;
+    uint8_t clocks_per_psram_clock;
+    uint8_t command_cycles;    // From top to the end of the command and address nibbles
+    uint8_t read_wait_cycles;  // From do_read to the first data nibble, covering the PSRAM wait states
+    uint8_t nibble_cycles;     // Per data nibble, including the final nibbles read in rd_rem
+    uint8_t read_one_cycles;   // do_read_one, including its two data nibbles
+};
+
+#define sram_offset_do_write 7u
+#define sram_offset_do_read_one 11u
+#define sram_offset_do_read 16u
+
+extern const pio_program sram_program;
+extern const pio_program sram_slow_program;
+extern const pio_program sram_fast_program;
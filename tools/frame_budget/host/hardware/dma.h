@@ -0,0 +1,14 @@
+#pragma once
+
+// Just enough of the Pico SDK to declare pimoroni::APS6404 on the host
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t ctrl;
+} dma_channel_config;
+
+static inline bool dma_channel_is_busy(uint channel) {
+    (void)channel;
+    return false;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// Just enough of the Pico SDK to declare pimoroni::APS6404 on the host
+
+#include <stdint.h>
+#include <assert.h>
+
+typedef unsigned int uint;
+
+typedef struct pio_hw pio_hw_t;
+typedef pio_hw_t* PIO;
+typedef struct pio_program pio_program_t;
+
+#define pio0 ((PIO)nullptr)
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// PSRAM contents and timing for the host APS6404
+namespace host_ram {
+    // Load an image, it is placed at address 0 and the rest of the RAM reads as 0
+    void load(const uint8_t* data, size_t len);
+
+    // The system clock the PSRAM timing is modelled at, default 252MHz.
+    // Call APS6404::adjust_clock() after changing it, as on the device.
+    void set_sys_clock_khz(uint32_t khz);
+    uint32_t get_sys_clock_khz();
+
+    // Read calls, words read, read commands (bursts) sent to the PIO, and the system clocks
+    // the PIO program takes to run those commands, since the last reset
+    struct Stats {
+        uint32_t reads;
+        uint32_t words;
+        uint32_t bursts;
+        uint32_t cycles;
+    };
+    const Stats& get_stats();
+    void reset_stats();
+}
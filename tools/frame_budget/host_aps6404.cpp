@@ -0,0 +1,101 @@
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include "aps6404.hpp"
+#include "aps6404.pio.h"
+#include "host_ram.hpp"
+
+// APS6404 backed by a memory image.  Reads complete immediately, running the command lists
+// built by the driver's own code in aps6404_cmds.cpp through a model of the PIO programs.
+
+const pio_program sram_program      = { "sram",      2, 19, 18, 2, 22 };
+const pio_program sram_slow_program = { "sram_slow", 2, 19, 17, 2, 21 };
+const pio_program sram_fast_program = { "sram_fast", 3, 27, 25, 3, 23 };
+
+namespace {
+    std::vector<uint8_t> ram_image(pimoroni::APS6404::RAM_SIZE);
+    uint32_t sys_clock_khz = 252000;
+    host_ram::Stats stats;
+}
+
+namespace host_ram {
+    void load(const uint8_t* data, size_t len) {
+        std::fill(ram_image.begin(), ram_image.end(), 0);
+        memcpy(ram_image.data(), data, std::min(len, ram_image.size()));
+    }
+
+    void set_sys_clock_khz(uint32_t khz) { sys_clock_khz = khz; }
+    uint32_t get_sys_clock_khz() { return sys_clock_khz; }
+
+    const Stats& get_stats() { return stats; }
+    void reset_stats() { stats = {}; }
+}
+
+namespace pimoroni {
+    APS6404::APS6404(uint pin_csn, uint pin_d0, PIO pio)
+        : pin_csn(pin_csn)
+        , pin_d0(pin_d0)
+        , pio(pio)
+        , pio_offset(0)
+    {
+        adjust_clock();
+    }
+
+    // The default timings for the clock, as on the device
+    void APS6404::adjust_clock() {
+        if (sys_clock_khz > MAX_HALF_CLOCK_SYS_HZ / 1000) {
+            set_read_timing(4);
+        }
+        else if (sys_clock_khz < 130000) {
+            set_read_timing(0);
+        }
+        else {
+            set_read_timing(1);
+        }
+    }
+
+    void APS6404::set_read_timing(int timing) {
+        const bool fast = timing >= 4;
+        const bool slow = !fast && (timing & 1) == 0;
+        pio_prog = fast ? &sram_fast_program : slow ? &sram_slow_program : &sram_program;
+        page_crossing_allowed = sys_clock_khz / pio_prog->clocks_per_psram_clock <= 84000;
+    }
+
+    void APS6404::read(uint32_t addr, uint32_t* read_buf, uint32_t len_in_words) {
+        uint32_t* cmd_buf = add_read_to_cmd_buffer(multi_read_cmd_buffer, addr, len_in_words << 2);
+        multi_read_cmds(multi_read_cmd_buffer, cmd_buf - multi_read_cmd_buffer, read_buf, len_in_words);
+    }
+
+    void APS6404::multi_read(uint32_t* addresses, uint32_t* lengths, uint32_t num_reads, uint32_t* read_buf, int chain_channel) {
+        const uint32_t total_len = build_multi_read_cmds(addresses, lengths, num_reads);
+        multi_read_cmds(multi_read_cmd_buffer, multi_read_cmd_len, read_buf, total_len >> 2, chain_channel);
+    }
+
+    void APS6404::multi_read_cmds(const uint32_t* cmds, uint32_t num_cmd_words, uint32_t* read_buf, uint32_t total_len_in_words, int chain_channel) {
+        uint8_t* buf = (uint8_t*)read_buf;
+        for (uint32_t i = 0; i + 3 <= num_cmd_words; i += 3) {
+            const bool read_one = cmds[i + 2] == pio_offset + sram_offset_do_read_one;
+            const uint32_t len = read_one ? 1 : (cmds[i] + 4) >> 1;
+            const uint32_t addr = cmds[i + 1] & 0xFFFFFF;
+
+            // Where bursts can't cross a page, they wrap to the start of it
+            for (uint32_t j = 0; j < len; ++j) {
+                uint32_t byte_addr = addr + j;
+                if (!page_crossing_allowed) byte_addr = (addr & ~(PAGE_SIZE - 1)) | (byte_addr & (PAGE_SIZE - 1));
+                *buf++ = ram_image[byte_addr & (RAM_SIZE - 1)];
+            }
+
+            ++stats.bursts;
+            stats.cycles += pio_prog->command_cycles;
+            if (read_one) stats.cycles += pio_prog->read_one_cycles;
+            else stats.cycles += pio_prog->read_wait_cycles + len * 2 * pio_prog->nibble_cycles;
+        }
+
+        ++stats.reads;
+        stats.words += total_len_in_words;
+    }
+
+    void APS6404::wait_for_finish_blocking() {
+    }
+}
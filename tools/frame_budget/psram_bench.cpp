@@ -0,0 +1,189 @@
+// PSRAM line read benchmark
+//
+// Reads a frame of each of a set of representative line layouts, building the PSRAM commands with
+// the driver's own APS6404::multi_read and timing them with the model of the PIO programs in
+// host_aps6404.cpp.  Reports the bursts, PIO time and achieved bandwidth of each layout, so
+// changes to the PSRAM read path can be measured before trying them on hardware.
+//
+// The data read is checked against what the separate reads for each line ask for, so a change
+// that merges reads it shouldn't is reported as a mismatch.
+//
+// Usage: psram_bench [options]
+//   -t <h_total>,<bit_clk_khz>  Timing, default 800,252000 (640x480p60)
+//   -w <h_length>               Frame width in pixels, default 640
+//   -l <v_length>               Frame height in lines, default 480
+//   -c <sys_clk_khz>            System clock, default is the bit clock, as the driver runs
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include "aps6404.hpp"
+#include "constants.hpp"
+#include "host_ram.hpp"
+
+namespace {
+    // A line read as DisplayDriver::read_two_lines makes it, after the scroll offset is applied
+    struct LineRead {
+        uint32_t address;
+        uint32_t len;
+        int16_t wrap_position = 0;  // As ScrollConfig, 0 if the line doesn't wrap
+        int16_t wrap_offset = 0;    // As stored in ScrollConfig, the offset plus the position
+    };
+
+    struct Layout {
+        const char* name;
+        const char* description;
+        LineRead (*line)(int y, uint32_t h_length);
+    };
+
+    // A ring of width bytes for each line, stride bytes apart, showing len bytes from scroll_x onwards
+    LineRead ring_line(int y, uint32_t stride, uint32_t width, uint32_t len, uint32_t scroll_x) {
+        LineRead line = { y * stride + scroll_x, len };
+        line.wrap_position = width - scroll_x;
+        line.wrap_offset = line.wrap_position - width;
+        return line;
+    }
+
+    const Layout layouts[] = {
+        { "linear", "ARGB1555, lines packed one after another",
+          [](int y, uint32_t h_length) { return LineRead{ y * h_length * 2, h_length * 2 }; } },
+        { "linear-doubled", "ARGB1555 pixel doubled, lines packed",
+          [](int y, uint32_t h_length) { return LineRead{ y * h_length, h_length }; } },
+        { "page-per-line", "ARGB1555 pixel doubled, each line at the start of a page",
+          [](int y, uint32_t h_length) { return LineRead{ y * 1024u, h_length }; } },
+        { "scrolled", "ARGB1555, 2kB wide playfield scrolled 200 bytes right",
+          [](int y, uint32_t h_length) { return LineRead{ y * 2048u + 200, h_length * 2 }; } },
+        { "wrapped-page", "ARGB1555 pixel doubled, each line wrapping in a 1kB page",
+          [](int y, uint32_t h_length) { return ring_line(y, 1024, 1024, h_length, 600); } },
+        { "wrapped", "ARGB1555 pixel doubled, each line wrapping in a ring of 1.25 times its width",
+          [](int y, uint32_t h_length) { return ring_line(y, h_length * 5 / 4, h_length * 5 / 4, h_length, 600); } },
+        { "mixed", "Repeating RGB888 doubled, 256 colour doubled, ARGB1555 and 32 colour lines, packed",
+          [](int y, uint32_t h_length) {
+              // Bytes per line for each mode in the cycle, and the bytes in one cycle of 4 lines
+              const uint32_t lens[4] = { h_length * 3 / 2, h_length / 2, h_length * 2, h_length };
+              const uint32_t cycle_len = lens[0] + lens[1] + lens[2] + lens[3];
+              uint32_t address = (y >> 2) * cycle_len;
+              for (int i = 0; i < (y & 3); ++i) address += lens[i];
+              return LineRead{ address, lens[y & 3] };
+          } },
+    };
+
+    // Every byte of the image is different from its neighbours and from the bytes a page away
+    uint8_t pattern_byte(uint32_t address) {
+        return uint8_t((address * 0x9E3779B1u) >> 24) ^ uint8_t(address >> 10);
+    }
+
+    [[noreturn]] void usage() {
+        fprintf(stderr, "Usage: psram_bench [-t h_total,bit_clk_khz] [-w h_length] [-l v_length] [-c sys_clk_khz]\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char** argv) {
+    uint32_t h_total = 800, bit_clk_khz = 252000, sys_clk_khz = 0;
+    uint32_t h_length = 640, v_length = 480;
+
+    for (int i = 1; i < argc; ++i) {
+        if (i + 1 >= argc || argv[i][0] != '-') usage();
+
+        const char* arg = argv[++i];
+        switch (argv[i - 1][1]) {
+            case 'w': h_length = strtoul(arg, nullptr, 0); break;
+            case 'l': v_length = strtoul(arg, nullptr, 0); break;
+            case 'c': sys_clk_khz = strtoul(arg, nullptr, 0); break;
+            case 't':
+                if (sscanf(arg, "%u,%u", &h_total, &bit_clk_khz) != 2) usage();
+                break;
+            default: usage();
+        }
+    }
+    if (sys_clk_khz == 0) sys_clk_khz = bit_clk_khz;
+    if (h_length == 0 || h_length > MAX_FRAME_WIDTH || (h_length & 3) || v_length == 0 || v_length > MAX_FRAME_HEIGHT) {
+        fprintf(stderr, "Frame must be up to %dx%d, with a width that is a multiple of 4\n", MAX_FRAME_WIDTH, MAX_FRAME_HEIGHT);
+        return 1;
+    }
+
+    std::vector<uint8_t> image(pimoroni::APS6404::RAM_SIZE);
+    for (uint32_t i = 0; i < image.size(); ++i) image[i] = pattern_byte(i);
+    host_ram::load(image.data(), image.size());
+    host_ram::set_sys_clock_khz(sys_clk_khz);
+
+    pimoroni::APS6404 ram;
+    ram.adjust_clock();
+
+    // Each line pair is read in the time it takes to output two lines
+    const uint32_t scanline_cycles = uint32_t((uint64_t(h_total) * sys_clk_khz) / (bit_clk_khz / 10));
+    const uint32_t pair_budget = 2 * scanline_cycles;
+
+    // The command format has bit 16 set when bursts may cross a page
+    printf("%ux%u, system clock %ukHz, %u cycles per line, bursts %s\n\n", h_length, v_length, sys_clk_khz, scanline_cycles,
+           (ram.get_read_cmd_format() & 0x10000) ? "may cross pages" : "wrap in their page");
+    printf("Layout          Bytes/line  Bursts/pair  Cycles/pair  Worst pair  Busy%%  MB/s  Bytes/line time\n");
+
+    int mismatches = 0;
+    int pairs_over = 0;
+    std::vector<uint32_t> buf(((MAX_FRAME_WIDTH + 1) * 3) / 2);
+    for (const Layout& layout : layouts) {
+        uint64_t total_bytes = 0, total_bursts = 0, total_cycles = 0;
+        uint32_t worst_cycles = 0;
+        const uint32_t num_pairs = (v_length + 1) >> 1;
+
+        for (uint32_t y = 0; y < v_length; y += 2) {
+            uint32_t addresses[4], lengths[4];
+            int num_reads = 0;
+            for (uint32_t i = y; i < std::min(y + 2, v_length); ++i) {
+                const LineRead line = layout.line(i, h_length);
+                addresses[num_reads] = line.address;
+                if (line.wrap_position > 0 && uint32_t(line.wrap_position) < line.len) {
+                    lengths[num_reads++] = line.wrap_position;
+                    addresses[num_reads] = line.address + line.wrap_offset;
+                    lengths[num_reads++] = line.len - line.wrap_position;
+                }
+                else {
+                    lengths[num_reads++] = line.len;
+                }
+            }
+
+            host_ram::reset_stats();
+            ram.multi_read(addresses, lengths, num_reads, buf.data());
+            const host_ram::Stats& stats = host_ram::get_stats();
+
+            const uint8_t* data = (const uint8_t*)buf.data();
+            for (int i = 0; i < num_reads; data += lengths[i++]) {
+                for (uint32_t j = 0; j < lengths[i]; ++j) {
+                    if (data[j] != pattern_byte(addresses[i] + j)) {
+                        if (mismatches++ < 10) printf("%s: lines %u-%u, read of 0x%06x got the wrong data\n", layout.name, y, y + 1, addresses[i]);
+                        break;
+                    }
+                }
+            }
+
+            total_bytes += stats.words * 4;
+            total_bursts += stats.bursts;
+            total_cycles += stats.cycles;
+            worst_cycles = std::max(worst_cycles, stats.cycles);
+            if (stats.cycles > pair_budget) ++pairs_over;
+        }
+
+        printf("%-14s  %10u  %11.2f  %11u  %10u  %5u  %4u  %15u\n", layout.name,
+               uint32_t(total_bytes / v_length),
+               double(total_bursts) / num_pairs,
+               uint32_t(total_cycles / num_pairs),
+               worst_cycles,
+               uint32_t((uint64_t(worst_cycles) * 100) / pair_budget),
+               uint32_t((total_bytes * sys_clk_khz) / (total_cycles * 1000)),
+               uint32_t((total_bytes * scanline_cycles) / total_cycles));
+    }
+
+    printf("\n");
+    for (const Layout& layout : layouts) {
+        printf("%-14s  %s\n", layout.name, layout.description);
+    }
+
+    if (pairs_over) printf("\n%d line pairs can't be read in the time to output them\n", pairs_over);
+    if (mismatches) printf("\n%d reads returned the wrong data\n", mismatches);
+    return mismatches ? 2 : 0;
+}